@@ -0,0 +1,85 @@
+// epoll_ctl次数基准：回显服务器，统计每个请求平均触发的epoll_ctl次数
+// 编译：g++ -std=c++17 -O2 -DNDEBUG -I. bench_epoll_ctl.cpp fd_manager.cpp fiber.cpp hook.cpp ioscheduler.cpp scheduler.cpp thread.cpp timer.cpp uring.cpp -pthread -ldl -o bench_epoll_ctl
+// 运行：./bench_epoll_ctl [mode] > /dev/null，mode同IOManager构造参数，0为重新注册模式，2为持久注册模式
+#include "ioscheduler.h"
+#include "hook.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace sylar;
+
+static const int kClients = 4;
+static const int kRequests = 5000;
+
+int main(int argc, char** argv)
+{
+    int mode = argc > 1 ? atoi(argv[1]) : 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    listen(listen_fd, 128);
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*)&addr, &len);
+
+    IOManager iom(3, true, "bench", mode);
+    iom.scheduleLock([&] {
+        set_hook_enable(true);
+        while(true)
+        {
+            // t_hook_enable是线程局部的，协程可能在别的工作线程上恢复，每次调用前重新打开
+            set_hook_enable(true);
+            int conn = accept(listen_fd, nullptr, nullptr);
+            if(conn < 0) break;
+            iom.scheduleLock([conn] {
+                set_hook_enable(true);
+                char buf[256];
+                while(true)
+                {
+                    set_hook_enable(true);
+                    ssize_t n = read(conn, buf, sizeof(buf));
+                    if(n <= 0) break;
+                    write(conn, buf, n);
+                }
+                close(conn);
+            });
+        }
+    });
+
+    // 客户端在普通线程里做同步的请求/响应往返
+    std::vector<std::thread> clients;
+    for(int i = 0; i < kClients; i++)
+    {
+        clients.emplace_back([&] {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            connect(fd, (sockaddr*)&addr, sizeof(addr));
+            char buf[32] = "hello";
+            for(int j = 0; j < kRequests; j++)
+            {
+                write(fd, buf, 5);
+                read(fd, buf, 5);
+            }
+            close(fd);
+        });
+    }
+    for(auto& t : clients) t.join();
+    usleep(100000);
+
+    IOStats stats = iom.getIOStats();
+    // 框架自身的调试输出走stdout，结果写到stderr便于过滤
+    fprintf(stderr, "mode %d: epoll_ctl=%lu (%.2f per request) add=%lu del=%lu\n", mode,
+           (unsigned long)stats.epollCtls, (double)stats.epollCtls / (kClients * kRequests),
+           (unsigned long)stats.addEvents, (unsigned long)stats.delEvents);
+
+    shutdown(listen_fd, SHUT_RDWR);
+    return 0;
+}
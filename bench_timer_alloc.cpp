@@ -0,0 +1,55 @@
+// 定时器分配次数基准：统计稳态下每个定时器（add+cancel）触发的operator new次数
+// 编译：g++ -std=c++17 -O2 -DNDEBUG -I. bench_timer_alloc.cpp timer.cpp -pthread -o bench_timer_alloc
+#include "timer.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+using namespace sylar;
+
+static std::atomic<long> g_allocs{0};
+
+void* operator new(size_t n)
+{
+    g_allocs++;
+    void* p = malloc(n ? n : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+struct BenchTimerManager : TimerManager
+{
+    void onTimerInsertedAtFront(size_t) override {}
+};
+
+int main()
+{
+    BenchTimerManager tm;
+    auto cond = std::make_shared<int>(1);
+    std::vector<std::shared_ptr<Timer>> timers;
+    timers.reserve(2000);
+
+    // 每轮1000个普通定时器和1000个条件定时器，回调带捕获
+    auto churn = [&] {
+        for(int i = 0; i < 1000; i++)
+        {
+            int x = i;
+            timers.push_back(tm.addTimer(5000 + i, [x]{ (void)x; }, false));
+            timers.push_back(tm.addConditionTimer(5000 + i, [x]{ (void)x; }, cond, false));
+        }
+        for(auto& t : timers) t->cancel();
+        timers.clear();
+    };
+
+    // 预热：对象池和堆数组达到稳定大小后再计数
+    for(int i = 0; i < 5; i++) churn();
+    long before = g_allocs;
+    for(int i = 0; i < 100; i++) churn();
+    long after = g_allocs;
+    printf("allocations per timer (add+cancel): %.3f (%ld over 200000 timers)\n", (after - before) / 200000.0, after - before);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// 定时器容器基准：TimerManager（分片4叉堆）对比旧的std::set实现
+// 编译：g++ -std=c++17 -O2 -DNDEBUG -I. bench_timer_heap.cpp timer.cpp -pthread -o bench_timer_heap
+#include "timer.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+
+using namespace sylar;
+
+struct BenchTimerManager : TimerManager
+{
+    void onTimerInsertedAtFront(size_t) override {}
+};
+
+// 旧实现的等价物：按超时时间排序的std::set，refresh/cancel都要先find再erase
+struct SetTimerManager
+{
+    struct Entry
+    {
+        std::chrono::time_point<std::chrono::system_clock> next;
+        std::function<void()> cb;
+    };
+    struct Comparator
+    {
+        bool operator()(const std::shared_ptr<Entry>& lhs, const std::shared_ptr<Entry>& rhs) const
+        {
+            if(lhs->next != rhs->next) return lhs->next < rhs->next;
+            return lhs.get() < rhs.get();
+        }
+    };
+
+    std::shared_ptr<Entry> add(uint64_t ms, std::function<void()> cb)
+    {
+        auto entry = std::make_shared<Entry>();
+        entry->next = std::chrono::system_clock::now() + std::chrono::milliseconds(ms);
+        entry->cb = std::move(cb);
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_timers.insert(entry);
+        return entry;
+    }
+
+    void refresh(const std::shared_ptr<Entry>& entry, uint64_t ms)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_timers.find(entry);
+        if(it == m_timers.end()) return;
+        m_timers.erase(it);
+        entry->next = std::chrono::system_clock::now() + std::chrono::milliseconds(ms);
+        m_timers.insert(entry);
+    }
+
+    void cancel(const std::shared_ptr<Entry>& entry)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_timers.find(entry);
+        if(it != m_timers.end()) m_timers.erase(it);
+    }
+
+    std::shared_mutex m_mutex;
+    std::set<std::shared_ptr<Entry>, Comparator> m_timers;
+};
+
+static const int kRounds = 20;
+static const int kTimers = 100000;
+
+template<class Run>
+static void report(const char* name, Run run)
+{
+    long ops = 0;
+    auto start = std::chrono::steady_clock::now();
+    run(ops);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-6s %.1f ns/op over %ld insert/refresh/cancel ops\n", name, ns / ops, ops);
+}
+
+int main()
+{
+    // 超时范围1ms..60s，覆盖短定时器与长定时器混合的场景
+    std::uniform_int_distribution<uint64_t> dist(1, 60000);
+
+    report("heap", [&](long& ops) {
+        BenchTimerManager tm;
+        std::mt19937 rng(1);
+        std::vector<std::shared_ptr<Timer>> timers;
+        timers.reserve(kTimers);
+        for(int round = 0; round < kRounds; round++)
+        {
+            for(int i = 0; i < kTimers; i++) { timers.push_back(tm.addTimer(1000 + dist(rng), []{}, false)); ops++; }
+            for(auto& t : timers) { t->refresh(); ops++; }
+            for(auto& t : timers) { t->cancel(); ops++; }
+            timers.clear();
+        }
+    });
+
+    report("set", [&](long& ops) {
+        SetTimerManager tm;
+        std::mt19937 rng(1);
+        std::vector<std::pair<std::shared_ptr<SetTimerManager::Entry>, uint64_t>> timers;
+        timers.reserve(kTimers);
+        for(int round = 0; round < kRounds; round++)
+        {
+            for(int i = 0; i < kTimers; i++)
+            {
+                uint64_t ms = 1000 + dist(rng);
+                timers.emplace_back(tm.add(ms, []{}), ms);
+                ops++;
+            }
+            for(auto& t : timers) { tm.refresh(t.first, t.second); ops++; }
+            for(auto& t : timers) { tm.cancel(t.first); ops++; }
+            timers.clear();
+        }
+    });
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "fd_manager.h"
 #include "hook.h"
+#include "ioscheduler.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,20 +14,137 @@ namespace sylar{
 	// Static variables need to be defined outside the class
 	// 这些行代码定义了 Singleton 类模板的静态成员变量 instance 和 mutex。静态成员变量需要在类外部定义和初始化。
 	template<typename T>
-	T* Singleton<T>::instance = nullptr;
+	std::atomic<T*> Singleton<T>::instance = {nullptr};
 
 	template<typename T>
 	std::mutex Singleton<T>::mutex;
 
-	FdCtx::FdCtx(int fd):
-	m_fd(fd)
+	// 进程退出时恢复阻塞模式的FdManager，析构时清空
+	static std::atomic<FdManager*> s_exit_manager = {nullptr};
+
+	static void restore_blocking_at_exit()
+	{
+		FdManager* mgr = s_exit_manager.load(std::memory_order_acquire);
+		if (mgr)
+		{
+			mgr->restoreBlocking();
+		}
+	}
+
+	// 根据传入的事件event，返回对应事件上下文的引用。
+	FdCtx::EventContext& FdCtx::getEventContext(int event)
+	{
+		assert(event==IOManager::READ || event==IOManager::WRITE); // 判断事件要么是读事件，或者写事件
+		if(event == IOManager::READ)
+		{
+			return read;
+		}
+		return write;
+	}
+
+	// 重置EventContext事件的上下文，将其恢复到初始或者空的状态。主要作用是清理并重置传入的 EventContext 对象，使其不再与任何调度器、线程或回调函数相关联。
+	void FdCtx::resetEventContext(EventContext &ctx)
+	{
+		ctx.waiters.clear();
+	}
+
+	void FdCtx::wakeWaiter(Waiter& waiter, uint64_t ready_time)
+	{
+		// 把真正要执行的函数放入到任务队列中等线程取出后任务后，协程执行，执行完成后返回主协程继续，执行run方法取任务执行任务(不过可能是不同的线程的协程执行了)。
+		if (waiter.cb)
+		{
+			// call ScheduleTask(std::function<void()>* f, int thr)
+			// 每线程epoll模式下回到轮询这个fd的线程上执行，其他模式ownerThread为-1
+			waiter.scheduler->scheduleLock(&waiter.cb, ownerThread);
+		}
+		else
+		{
+			if (ready_time)
+			{
+				waiter.fiber->setReadyTime(ready_time);
+			}
+			// call ScheduleTask(std::shared_ptr<Fiber>* f, int thr)
+			waiter.scheduler->scheduleLock(&waiter.fiber, ownerThread);
+		}
+		waiter.scheduler = nullptr;
+	}
+
+	// 函数负责在指定的 IO 事件被触发时，唤醒等待它的协程或回调函数，并且在唤醒之后清理相关的等待者。
+	// no lock
+	size_t FdCtx::triggerEvent(int event, uint64_t ready_time, bool all)
+	{
+		assert(events & event); // 确保event是中有指定的事件，否则程序中断。
+
+		EventContext& ctx = getEventContext(event);
+		size_t n = ctx.waiters.size();
+		if (ctx.wakeOne && !all && n > 1)
+		{
+			n = 1;
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			wakeWaiter(ctx.waiters[i], ready_time);
+		}
+		ctx.waiters.erase(ctx.waiters.begin(), ctx.waiters.begin() + n);
+
+		// delete event
+		// 没有等待者之后清理该事件，表示不再关注，也就是说，注册IO事件是一次性的，
+		// 如果想持续关注某个Socket fd的读写事件，那么每次触发事件后都要重新添加
+		if (ctx.waiters.empty())
+		{
+			events = events & ~event; // 对标志位取反再相加就是相当于将event从events中删除
+		}
+		return n;
+	}
+
+	void FdCtx::resetHookState()
 	{
-		init();
+		m_isInit = false;
+		m_isSocket = false;
+		m_isPollable = false;
+		m_origNonblock = false;
+		m_sysNonblock = false;
+		m_userNonblock = false;
+		m_isClosed = false;
+		m_recvTimeout = (uint64_t)-1;
+		m_sendTimeout = (uint64_t)-1;
+		m_nowaitUnsupported.store(false, std::memory_order_relaxed);
+		dropTimeoutTimers();
 	}
 
-	FdCtx::~FdCtx()
+	void FdCtx::restoreBlocking(int file_fd)
 	{
+		if (!needRestoreBlocking() || m_userNonblock)
+		{
+			return;
+		}
+		if (file_fd < 0)
+		{
+			file_fd = fd;
+		}
+		int flags = fcntl_f(file_fd, F_GETFL, 0);
+		if (flags != -1)
+		{
+			fcntl_f(file_fd, F_SETFL, flags & ~O_NONBLOCK);
+		}
+	}
 
+	void FdCtx::dropTimeoutTimers(uint64_t manager_id)
+	{
+		for (int type : {SO_RCVTIMEO, SO_SNDTIMEO})
+		{
+			// 占用之后再改，不和正在arm_wait_timer中使用它的协程冲突
+			if (!acquireTimeoutTimer(type))
+			{
+				continue;
+			}
+			std::shared_ptr<Timer>& timer = getTimeoutTimer(type);
+			if (timer && (manager_id == 0 || timer->getManagerId() == manager_id))
+			{
+				timer.reset();
+			}
+			releaseTimeoutTimer(type);
+		}
 	}
 
 	bool FdCtx::init() {
@@ -36,24 +154,28 @@ namespace sylar{
 
 		struct stat statbuf;
 		// fd is in valid
-		// fstat 函数用于获取与文件描述符 m_fd 关联的文件状态信息存放到 statbuf 中。如果 fstat() 返回 -1，表示文件描述符无效或出现错误。
-		if (-1 == fstat(m_fd, &statbuf)) {
+		// fstat 函数用于获取与文件描述符 fd 关联的文件状态信息存放到 statbuf 中。如果 fstat() 返回 -1，表示文件描述符无效或出现错误。
+		if (-1 == fstat(fd, &statbuf)) {
 			m_isInit = false;
 			m_isSocket = false;
+			m_isPollable = false;
 		} else {
 			m_isInit = true;
 			m_isSocket = S_ISSOCK(statbuf.st_mode); // S_ISSOCK(statbuf.st_mode) 用于判断文件类型是否为套接字
+			// eventfd、timerfd等匿名inode没有文件类型位，也算在可等待的一类里
+			m_isPollable = !S_ISREG(statbuf.st_mode) && !S_ISDIR(statbuf.st_mode) && !S_ISBLK(statbuf.st_mode);
 		}
 
-		// if it is a socket -> set to nonblock
-		if (m_isSocket) { // 表示 m_fd 关联的文件是一个套接字：
-			int flags = fcntl_f(m_fd, F_GETFL, 0); // 获取文件描述符的状态
+		// if it is pollable -> set to nonblock
+		if (m_isPollable) { // 表示 fd 可以用epoll等待：
+			int flags = fcntl_f(fd, F_GETFL, 0); // 获取文件描述符的状态
+			m_origNonblock = flags & O_NONBLOCK;
 			if (!(flags & O_NONBLOCK)) {
-				fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK); // 检查当前标志中是否已经设置了非阻塞标志。如果没有设置：
+				fcntl_f(fd, F_SETFL, flags | O_NONBLOCK); // 检查当前标志中是否已经设置了非阻塞标志。如果没有设置：
 			}
 			m_sysNonblock = true; // hook 非阻塞设置成功
 		} else {
-			m_sysNonblock = false; // 如果不是一个 socket 那就没必要设置非阻塞了。
+			m_sysNonblock = false; // 普通文件等epoll不能等待，没必要设置非阻塞了。
 		}
 
 		return m_isInit; // 即初始化是否成功
@@ -77,55 +199,159 @@ namespace sylar{
 
 	FdManager::FdManager()
 	{
-		m_datas.resize(64); // 分配空间
+		lookup(0, true); // 预先分配第一段，覆盖最常用的小fd
+
+		s_exit_manager.store(this, std::memory_order_release);
+		static std::once_flag once;
+		std::call_once(once, []() { atexit(restore_blocking_at_exit); });
 	}
 
-	// 获取m_datas数组中FdCtx的对象，如果FdCtx对象不存在并且m_datas.size()<=fd的话会先扩展数组大小，然后通过Fd_Ctx的构造函数创建其对象存放到m_datas数组中。
-	std::shared_ptr<FdCtx> FdManager::get(int fd, bool auto_create)
+	FdManager::~FdManager()
 	{
-		if(fd==-1) // 文件描述符无效则直接返回。
+		restoreBlocking();
+		FdManager* self = this;
+		s_exit_manager.compare_exchange_strong(self, nullptr, std::memory_order_acq_rel);
+		for(size_t i=0;i<CHUNK_COUNT;i++)
+		{
+			delete[] m_chunks[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	// 两级表：fd的高位选段，低位是段内下标。段一旦分配就不再移动或释放，查找只需要两次load，
+	// 新段由第一个需要它的线程分配并用CAS发布，竞争失败的一方释放自己分配的段，不会阻塞其他线程的查找
+	FdCtx* FdManager::lookup(int fd, bool auto_create)
+	{
+		if(fd < 0 || (size_t)fd >= CHUNK_COUNT * CHUNK_SIZE)
 		{
 			return nullptr;
 		}
 
-		std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-		// 如果 fd 超出了 m_datas 的范围，并且 auto_create 为 false，则返回 nullptr，表示没有创建新对象的需求。
-		if(m_datas.size() <= fd)
+		std::atomic<FdCtx*>& slot = m_chunks[fd / CHUNK_SIZE];
+		FdCtx* chunk = slot.load(std::memory_order_acquire);
+		if(!chunk)
 		{
-			if(auto_create==false)
+			if(!auto_create)
 			{
 				return nullptr;
 			}
+
+			FdCtx* fresh = new FdCtx[CHUNK_SIZE];
+			for(size_t i=0;i<CHUNK_SIZE;i++)
+			{
+				fresh[i].fd = (fd / CHUNK_SIZE) * CHUNK_SIZE + i; // 将文件描述符的编号赋值给 fd
+			}
+			if(slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				chunk = fresh;
+			}
+			else
+			{
+				delete[] fresh;
+			}
 		}
-		else
+		return &chunk[fd % CHUNK_SIZE];
+	}
+
+	// 在记录的锁内接管并初始化，同一个fd并发的接管只会初始化一次
+	FdCtx* FdManager::activate(int fd, bool fresh)
+	{
+		FdCtx* ctx = lookup(fd, true);
+		if(!ctx)
+		{
+			return nullptr;
+		}
+
+		if(!fresh && fd <= STDERR_FILENO && !ctx->m_active.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		if(fresh || !ctx->m_active.load(std::memory_order_relaxed))
 		{
-			if(m_datas[fd]||!auto_create)
+			ctx->resetHookState();
+			ctx->init();
+			// 第一次I/O时才接管的fd(没有经过hook创建的管道、eventfd等)：之前已经是非阻塞的，说明用户要的就是非阻塞语义
+			if(!fresh)
 			{
-				return m_datas[fd];
+				ctx->setUserNonblock(ctx->m_origNonblock);
 			}
+			// 无效的fd不接管，之后同号的fd被打开时重新判断
+			ctx->m_active.store(fresh || ctx->isInit(), std::memory_order_release);
 		}
-		// 当fd的大小超出m_data.size的值也就是m_datas[fd]数组中没找到对应的fd并且auto_create为true时候会走到这里。
-		read_lock.unlock();
-		std::unique_lock<std::shared_mutex> write_lock(m_mutex); // 写锁
+		return ctx;
+	}
 
-		if(m_datas.size() <= fd)
+	FdCtx* FdManager::dup(int oldfd, int newfd)
+	{
+		FdCtx* old_ctx = get(oldfd, true);
+		if(!old_ctx)
 		{
-			m_datas.resize(fd*1.5); // 扩容
+			// newfd之前的接管状态(dup2覆盖的fd)也不再有效
+			del(newfd);
+			return nullptr;
+		}
+		FdCtx* new_ctx = create(newfd);
+		if(!new_ctx)
+		{
+			return nullptr;
+		}
+		if(new_ctx == old_ctx)
+		{
+			return new_ctx;
 		}
 
-		m_datas[fd] = std::make_shared<FdCtx>(fd);
-		return m_datas[fd];
+		// activate也在这两个锁内修改这些字段
+		std::scoped_lock lock(old_ctx->mutex, new_ctx->mutex);
+		new_ctx->m_userNonblock = old_ctx->m_userNonblock;
+		new_ctx->m_recvTimeout = old_ctx->m_recvTimeout;
+		new_ctx->m_sendTimeout = old_ctx->m_sendTimeout;
+		new_ctx->m_nowaitUnsupported.store(old_ctx->isNowaitUnsupported(), std::memory_order_relaxed);
+		old_ctx->m_origNonblock = true;
+		new_ctx->m_origNonblock = true;
+		return new_ctx;
 	}
 
-	// 删除指定文件描述的FdCtx对象
+	// fd不再被hook接管。记录留在表中，之前拿到指针的协程仍然可以安全地访问它
 	void FdManager::del(int fd)
 	{
-		std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-		if(m_datas.size() <= fd)
+		FdCtx* ctx = lookup(fd, false);
+		if(ctx)
 		{
-			return;
+			ctx->m_active.store(false, std::memory_order_release);
 		}
-		m_datas[fd].reset(); // 智能指针share调用reset()减少其对对象的引用计数，当引用计数为0销毁对象。
 	}
 
-}
\ No newline at end of file
+	void FdManager::restoreBlocking()
+	{
+		// 进程退出时其他线程可能还在运行，记录正被占用就跳过，不在退出时死锁
+		forEach([](FdCtx& ctx)
+		{
+			if(!ctx.m_active.load(std::memory_order_acquire))
+			{
+				return;
+			}
+			std::unique_lock<std::mutex> lock(ctx.mutex, std::try_to_lock);
+			if(lock.owns_lock())
+			{
+				ctx.restoreBlocking();
+			}
+		});
+	}
+
+	void FdManager::forEach(const std::function<void(FdCtx&)>& fn)
+	{
+		for(size_t i=0;i<CHUNK_COUNT;i++)
+		{
+			FdCtx* chunk = m_chunks[i].load(std::memory_order_acquire);
+			if(!chunk)
+			{
+				continue;
+			}
+			for(size_t j=0;j<CHUNK_SIZE;j++)
+			{
+				fn(chunk[j]);
+			}
+		}
+	}
+}
@@ -2,36 +2,124 @@
 #define _FD_MANAGER_H_
 
 #include <memory>
-#include <shared_mutex>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <sys/socket.h>
 #include "thread.h"
+#include "timer.h"
+#include "scheduler.h"
 
 // 定义了两个主要的类：FdCtx 和 FdManager，用于管理文件描述符（fd）的上下文和其相关的操作。
 namespace sylar{
 
+	struct UringStream;
+
 	// fd info
-	// 主要用于管理与文件描述符相关的状态和操作。
-	class FdCtx : public std::enable_shared_from_this<FdCtx>
+	// 每个fd一条记录，hook的状态(是否socket、非阻塞标志、超时)和IOManager的事件状态(注册的事件、等待者)放在一起，
+	// 一次查找就能拿到。记录存放在FdManager的两级表中，分配后不再移动或释放，hook的快速路径直接使用裸指针，没有引用计数。
+	// 按缓存行对齐，相邻fd的记录不共享缓存行
+	class alignas(64) FdCtx
 	{
+	public:
+		// 一个等待者
+		struct Waiter
+		{
+			// 三元组信息，分别是描述符-事件类型(可读可写事件)-回调函数
+			// scheduler
+			Scheduler *scheduler = nullptr; // 关联的调度器。
+			// callback fiber
+			std::shared_ptr<Fiber> fiber; // 关联的回调线程（协程）。
+			// callback function
+			std::function<void()> cb; // 关联的回调函数。
+		};
+
+		// 一个方向(读或写)上的等待者，按等待的先后排队。记录不会释放，vector的容量留着给之后的等待复用
+		struct EventContext
+		{
+			std::vector<Waiter> waiters;
+			// 就绪时只唤醒最早的一个等待者，否则唤醒全部
+			bool wakeOne = false;
+		};
+
+		// ---- IOManager的事件状态，由IOManager在mutex保护下直接读写 ----
+		std::mutex mutex;
+		int fd = -1; // 事件关联的fd(句柄)(文件描述符)，由FdManager分配记录时设置
+		// events registered，IOManager::Event的组合
+		int events = 0; // 当前注册的事件，可能是 READ、WRITE 或二者的组合。
+		// 持久注册模式：是否已经注册到epoll，以及没有等待者时到达的就绪事件
+		bool registered = false;
+		int ready = 0;
+		// 每线程epoll模式：fd注册在哪个工作线程的epoll实例中(m_pollers下标)以及该线程的id，-1表示注册在共享的m_epfd中
+		int owner = -1;
+		int ownerThread = -1;
+		// 忙轮询模式：是否已经设置了SO_BUSY_POLL
+		bool busyPoll = false;
+		// 注册了这个fd的IOManager，IOManager析构时据此清理自己留下的状态
+		const void* manager = nullptr;
+		// io_uring模式：fd上的multishot请求(accept或recv)的完成事件流，close时解除
+		std::shared_ptr<UringStream> multishot;
+		// io_uring模式：已经提交、还没有完成的单次操作数。close时没有在途的操作就不必提交取消请求
+		std::atomic<int> uringOps = {0};
+		// read event context
+		EventContext read; // read和write表示读和写的上下文
+		// write event context
+		EventContext write;
+
+		EventContext& getEventContext(int event); // 根据事件类型获取相应的事件上下文（如读事件上下文或写事件上下文）。
+		void resetEventContext(EventContext &ctx); // 重置事件上下文，丢弃所有等待者(不唤醒)。
+		// 触发事件：按wakeOne唤醒最早的一个或者全部等待者，让调度器去调度它们的协程或函数，没有等待者之后从events中去掉该事件。
+		// all为true时不论wakeOne都唤醒全部(取消时用)。返回唤醒的等待者数量。
+		// ready_time是发现就绪的时间(steady_clock纳秒)，记在等待的协程上用于统计唤醒延迟，0表示不统计
+		size_t triggerEvent(int event, uint64_t ready_time = 0, bool all = false);
+		// 唤醒一个等待者，把它的协程或函数交给调度器，waiter随之被清空
+		void wakeWaiter(Waiter& waiter, uint64_t ready_time = 0);
+
 	private:
+		friend class FdManager;
+
+		// 是否被hook接管：socket()/accept()等创建时置位，close时清除。没有置位时FdManager::get返回空
+		std::atomic<bool> m_active = {false};
 		bool m_isInit = false; // 标记文件描述符是否已初始化。
 		bool m_isSocket = false; // 标记文件描述符是否是一个套接字。
+		// 能否用epoll等待就绪：socket、管道/FIFO、字符设备(tty等)以及eventfd/timerfd/signalfd这类匿名inode。
+		// 普通文件、目录和块设备总是"就绪"，epoll不支持，对它们的I/O直接调用原始的系统调用
+		bool m_isPollable = false;
+		bool m_origNonblock = false; // 接管之前是否已经是非阻塞的
 		bool m_sysNonblock = false; // 标记文件描述符是否设置为系统非阻塞模式。
 		bool m_userNonblock = false; // 标记文件描述符是否设置为用户非阻塞模式。
 		bool m_isClosed = false; // 标记文件描述符是否已关闭。
-		int m_fd; // 文件描述符的整数值
 
 		// read event timeout
 		uint64_t m_recvTimeout = (uint64_t)-1; // 读事件的超时时间，默认为 -1 表示没有超时限制。
 		// write event timeout
 		uint64_t m_sendTimeout = (uint64_t)-1; // 写事件的超时时间，默认为 -1 表示没有超时限制。
 
-	public:
-		FdCtx(int fd);
-		~FdCtx();
+		// hook中等待读/写事件时使用的超时定时器。同一个fd上连续的阻塞操作复用同一个定时器，每次只重新设置超时时间
+		std::shared_ptr<Timer> m_recvTimer;
+		std::shared_ptr<Timer> m_sendTimer;
+		// 定时器是否正被某次等待占用
+		std::atomic<bool> m_recvTimerBusy = {false};
+		std::atomic<bool> m_sendTimerBusy = {false};
+		// 超时定时器被复用(重新启用)的次数，以及真正触发、使等待以ETIMEDOUT结束的次数
+		std::atomic<uint64_t> m_timerRearmed = {0};
+		std::atomic<uint64_t> m_timerFired = {0};
+		// 普通文件的RWF_NOWAIT试读写返回过EOPNOTSUPP/EINVAL(文件系统或内核不支持)，之后直接走异步路径
+		std::atomic<bool> m_nowaitUnsupported = {false};
+
+		// fd号被复用、重新被hook接管时清空上一次的hook状态，连同超时定时器
+		void resetHookState();
 
+	public:
 		bool init(); // 初始化 FdCtx 对象。
 		bool isInit() const {return m_isInit;}
 		bool isSocket() const {return m_isSocket;}
+		bool isPollable() const {return m_isPollable;}
+		// 接管时是阻塞的非socket fd(管道、tty等常和其他进程共享打开的文件)，close时恢复阻塞模式
+		bool needRestoreBlocking() const {return m_isPollable && !m_isSocket && !m_origNonblock;}
+		// 需要时把接管时设置的O_NONBLOCK去掉，还给共享同一打开文件的其他进程。
+		// file_fd是fd号被覆盖之后仍然指向原来那个文件的副本，-1表示就用fd
+		void restoreBlocking(int file_fd = -1);
 		bool isClosed() const {return m_isClosed;}
 
 		void setUserNonblock(bool v) {m_userNonblock = v;} // 设置和获取用户层面的非阻塞状态。
@@ -42,6 +130,20 @@ namespace sylar{
 		// 设置和获取超时时间，type 用于区分读事件和写事件的超时设置，v表示时间毫秒。
 		void setTimeout(int type, uint64_t v);
 		uint64_t getTimeout(int type);
+
+		// 获取读(SO_RCVTIMEO)或写(SO_SNDTIMEO)方向的超时定时器，还没有创建时为空
+		std::shared_ptr<Timer>& getTimeoutTimer(int type) {return type == SO_RCVTIMEO ? m_recvTimer : m_sendTimer;}
+		// 占用/归还该方向的超时定时器。同一方向上已有协程在等待时占用失败，调用方应为这次等待单独创建定时器
+		bool acquireTimeoutTimer(int type) {return !(type == SO_RCVTIMEO ? m_recvTimerBusy : m_sendTimerBusy).exchange(true);}
+		void releaseTimeoutTimer(int type) {(type == SO_RCVTIMEO ? m_recvTimerBusy : m_sendTimerBusy).store(false);}
+		// 丢弃两个方向的超时定时器。manager_id不为0时只丢弃属于该定时器管理器的；正被某次等待占用的留给那次等待
+		void dropTimeoutTimers(uint64_t manager_id = 0);
+		void addTimerRearmed() {m_timerRearmed.fetch_add(1, std::memory_order_relaxed);}
+		void addTimerFired() {m_timerFired.fetch_add(1, std::memory_order_relaxed);}
+		uint64_t getTimerRearmed() const {return m_timerRearmed.load(std::memory_order_relaxed);}
+		uint64_t getTimerFired() const {return m_timerFired.load(std::memory_order_relaxed);}
+		bool isNowaitUnsupported() const {return m_nowaitUnsupported.load(std::memory_order_relaxed);}
+		void setNowaitUnsupported() {m_nowaitUnsupported.store(true, std::memory_order_relaxed);}
 	};
 
 	// 用于管理 FdCtx 对象的集合。它提供了对文件描述符上下文的访问和管理功能。
@@ -49,13 +151,48 @@ namespace sylar{
 	{
 	public:
 		FdManager(); // 构造函数
-		// 获取指定文件描述符的 FdCtx 对象。如果 auto_create 为 true，在不存在时自动创建新的 FdCtx 对象。
-		std::shared_ptr<FdCtx> get(int fd, bool auto_create = false);
-		void del(int fd); // 删除指定文件描述符的 FdCtx 对象
+		~FdManager();
+		// 获取被hook接管的fd的记录。如果 auto_create 为 true，在没有接管时接管它并初始化hook状态。
+		// 读路径内联：两次load找到记录，一次load确认已经接管，不加锁也不复制智能指针
+		FdCtx* get(int fd, bool auto_create = false)
+		{
+			if(fd >= 0 && (size_t)fd < CHUNK_COUNT * CHUNK_SIZE)
+			{
+				FdCtx* chunk = m_chunks[fd / CHUNK_SIZE].load(std::memory_order_acquire);
+				if(chunk && chunk[fd % CHUNK_SIZE].m_active.load(std::memory_order_acquire))
+				{
+					return &chunk[fd % CHUNK_SIZE];
+				}
+			}
+			return auto_create ? activate(fd) : nullptr;
+		}
+		// fd刚由hook的系统调用(socket、accept等)创建：接管并重新初始化。
+		// 上一个同号的fd没有经过hook的close关闭时记录仍处于接管状态，不能沿用它的hook状态
+		FdCtx* create(int fd) {return activate(fd, true);}
+		// newfd是oldfd的副本(dup/dup2/dup3/F_DUPFD)：两者共享同一个打开的文件和O_NONBLOCK标志。
+		// 先接管oldfd，newfd继承它对用户的阻塞语义和超时；之后关闭任何一个都不再恢复阻塞模式，以免影响另一个。
+		// oldfd不接管(标准输入输出)时newfd也不接管
+		FdCtx* dup(int oldfd, int newfd);
+		void del(int fd); // fd不再被hook接管，记录本身保留
+
+		// 查找fd的记录，不论是否被hook接管(IOManager的事件状态用它)；auto_create时按需分配所在的段。
+		// fd超出表的范围，或者段还没有分配且不创建时返回nullptr
+		FdCtx* lookup(int fd, bool auto_create);
+		// 遍历所有已经分配的记录
+		void forEach(const std::function<void(FdCtx&)>& fn);
+		// 把所有仍被接管的fd恢复成接管前的阻塞模式。进程退出和FdManager析构时调用，
+		// 没有经过hook的close就留到最后的管道、终端等不会以非阻塞的状态留给父进程和子进程
+		void restoreBlocking();
 
 	private:
-		std::shared_mutex m_mutex; // 用于保护对 m_datas 的访问，支持共享读锁和独占写锁。
-		std::vector<std::shared_ptr<FdCtx>> m_datas; // 存储所有 FdCtx 对象的共享指针。
+		// get的慢路径：分配记录所在的段，接管fd并初始化hook状态；fresh为true时已经接管的也重新初始化。
+		// 不是由hook创建的标准输入输出(0-2)不接管：它们和父进程共享终端或管道，设成非阻塞会影响共享它们的其他进程
+		FdCtx* activate(int fd, bool fresh = false);
+
+		// 两级表：固定数量的段指针，每段CHUNK_SIZE条记录，按需分配后不再移动，查找不加锁
+		static const size_t CHUNK_SIZE = 256;
+		static const size_t CHUNK_COUNT = 16384; // 最多覆盖4M个fd
+		std::atomic<FdCtx*> m_chunks[CHUNK_COUNT] = {};
 	};
 
 
@@ -63,8 +200,8 @@ namespace sylar{
 	class Singleton
 	{
 	private:
-	    static T* instance; // 对外提供的实例
-	    static std::mutex mutex; // 互斥锁
+	    static std::atomic<T*> instance; // 对外提供的实例
+	    static std::mutex mutex; // 互斥锁，只在第一次创建和销毁时使用
 
 	protected:
 	    Singleton() {}
@@ -74,22 +211,29 @@ namespace sylar{
 	    Singleton(const Singleton&) = delete;
 	    Singleton& operator=(const Singleton&) = delete;
 
+	    // 每个hook的系统调用都会调用它：创建之后只是一次acquire load，不加锁
 	    static T* GetInstance()
 	    {
-	        std::lock_guard<std::mutex> lock(mutex); // Ensure thread safety 加锁
-	        if (instance == nullptr)
+	        T* p = instance.load(std::memory_order_acquire);
+	        if (p == nullptr)
 	        {
-	            instance = new T();
+	            std::lock_guard<std::mutex> lock(mutex); // Ensure thread safety 加锁
+	            p = instance.load(std::memory_order_relaxed);
+	            if (p == nullptr)
+	            {
+	                p = new T();
+	                instance.store(p, std::memory_order_release);
+	            }
 	        }
-	        return instance; // 提高对外的访问点，在系统生命周期中
+	        return p; // 提高对外的访问点，在系统生命周期中
 	    	// 一般一个类只有一个全局实例。
 	    }
 
+	    // 调用方保证此时没有其他线程在使用实例
 	    static void DestroyInstance()
 	    {
 	        std::lock_guard<std::mutex> lock(mutex);
-	        delete instance;
-	        instance = nullptr; // 防止野指针
+	        delete instance.exchange(nullptr); // 防止野指针
 	    }
 	};
 
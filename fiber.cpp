@@ -98,6 +98,7 @@ namespace sylar {
 	m_cb(cb), m_runInScheduler(run_in_scheduler)
 	{
 		m_state = READY; // 初始状态设为就绪
+		m_deadline = t_fiber ? t_fiber->m_deadline : 0; // 继承创建者的截止时间
 
 		// 分配协程私有栈空间（默认128KB）
 		m_stacksize = stacksize ? stacksize : 128000;
@@ -156,6 +157,7 @@ namespace sylar {
 
 		m_state = READY;
 		m_cb = cb; // 替换任务回调
+		m_deadline = t_fiber ? t_fiber->m_deadline : 0;
 
 		// 重新初始化上下文
 		if(getcontext(&m_ctx))
@@ -269,4 +271,41 @@ namespace sylar {
 		raw_ptr->yield(); // 确保控制权交还
 	}
 
-}
\ No newline at end of file
+	uint64_t Fiber::GetThisDeadline()
+	{
+		return t_fiber ? t_fiber->m_deadline : 0;
+	}
+
+	uint64_t Fiber::GetDeadlineRemaining()
+	{
+		uint64_t deadline = GetThisDeadline();
+		if(deadline == 0)
+		{
+			return (uint64_t)-1;
+		}
+		uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		return deadline > now ? deadline - now : 0;
+	}
+
+	DeadlineScope::DeadlineScope(std::chrono::nanoseconds timeout)
+	{
+		m_fiber = Fiber::GetThis();
+		m_saved = m_fiber->getDeadline();
+
+		uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		uint64_t deadline = now + (timeout.count() > 0 ? (uint64_t)timeout.count() : 0);
+		// 只收紧不放宽
+		if(m_saved == 0 || deadline < m_saved)
+		{
+			m_fiber->setDeadline(deadline);
+		}
+	}
+
+	DeadlineScope::~DeadlineScope()
+	{
+		m_fiber->setDeadline(m_saved);
+	}
+
+}
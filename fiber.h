@@ -9,6 +9,7 @@
 #include <ucontext.h>   
 #include <unistd.h>
 #include <mutex>
+#include <chrono>
 
 namespace sylar {
 
@@ -44,6 +45,28 @@ public:
 	uint64_t getId() const {return m_id;} // 获取唯一标识
 	State getState() const {return m_state;} // 获取协程状态
 
+	// 协程的截止时间(steady_clock纳秒)，0表示没有截止时间
+	uint64_t getDeadline() const {return m_deadline;}
+	void setDeadline(uint64_t deadline) {m_deadline = deadline;}
+
+	// hook中I/O等待的超时通知，取代每次等待都分配的timer_info。
+	// 等待状态 = 等待序号<<1 | 是否超时，序号和标志放在同一个原子变量里，超时回调用CAS只能标记它所属的那一次等待
+	// 开始一次新的等待，返回这次等待的标记
+	uint64_t beginWait()
+	{
+		uint64_t token = (m_waitState.load(std::memory_order_relaxed) | 1) + 1;
+		m_waitState.store(token, std::memory_order_release);
+		return token;
+	}
+	// 由超时定时器调用：等待仍未结束时标记为超时并返回true
+	bool timeoutWait(uint64_t token) {return m_waitState.compare_exchange_strong(token, token | 1);}
+	// 协程恢复后判断上一次等待是否因超时结束
+	bool waitTimedOut() const {return m_waitState.load(std::memory_order_acquire) & 1;}
+
+	// 等待的事件被IOManager发现就绪的时间(steady_clock纳秒)，调度器恢复协程前取出并清零，用于统计唤醒延迟
+	void setReadyTime(uint64_t t) {m_readyTime = t;}
+	uint64_t takeReadyTime() {uint64_t t = m_readyTime; m_readyTime = 0; return t;}
+
 public:
 	// 设置当前运行的协程
 	static void SetThis(Fiber *f);
@@ -60,6 +83,12 @@ public:
 	// 协程的主函数，入口点
 	static void MainFunc();	
 
+	// 得到当前运行协程的截止时间，没有运行中的协程时返回0
+	static uint64_t GetThisDeadline();
+
+	// 当前协程距离截止时间的剩余时间(ns)：没有截止时间返回(uint64_t)-1，已经超时返回0
+	static uint64_t GetDeadlineRemaining();
+
 private:
 	// id，协程唯一标识符
 	uint64_t m_id = 0;
@@ -75,11 +104,31 @@ private:
 	std::function<void()> m_cb;
 	// 是否让出执行权交给调度协程
 	bool m_runInScheduler;
+	// 截止时间，创建时继承自创建它的协程
+	uint64_t m_deadline = 0;
+	// I/O等待状态，见beginWait()
+	std::atomic<uint64_t> m_waitState{0};
+	// 见setReadyTime()，0表示不是被I/O事件唤醒的
+	uint64_t m_readyTime = 0;
 
 public:
 	std::mutex m_mutex;
 };
 
+// 在作用域内给当前协程设置一个整体的截止时间，离开作用域时恢复原来的值。
+// hook的read/write/connect/sleep等函数取fd超时和剩余时间中较小的一个；在该协程中创建的协程和调度的回调会继承这个截止时间。
+// 嵌套使用时只会收紧，不会放宽外层的截止时间。
+class DeadlineScope
+{
+public:
+	explicit DeadlineScope(std::chrono::nanoseconds timeout);
+	~DeadlineScope();
+
+private:
+	std::shared_ptr<Fiber> m_fiber;
+	uint64_t m_saved;
+};
+
 }
 
 #endif
@@ -4,7 +4,12 @@
 #include <iostream>
 #include <cstdarg>
 #include "fd_manager.h"
+#include "uring.h"
 #include <string.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 
 // apply XX to all functions
 #define HOOK_FUN(XX) \
@@ -14,6 +19,8 @@
     XX(socket) \
     XX(connect) \
     XX(accept) \
+    XX(accept4) \
+    XX(socketpair) \
     XX(read) \
     XX(readv) \
     XX(recv) \
@@ -25,6 +32,15 @@
     XX(sendto) \
     XX(sendmsg) \
     XX(close) \
+    XX(pipe) \
+    XX(pipe2) \
+    XX(dup) \
+    XX(dup2) \
+    XX(dup3) \
+    XX(open) \
+    XX(pread) \
+    XX(pwrite) \
+    XX(fsync) \
     XX(fcntl) \
     XX(ioctl) \
     XX(getsockopt) \
@@ -76,11 +92,323 @@ namespace sylar{
 
 } // end namespace sylar
 
-// 跟踪定时器的状态
-struct timer_info
+
+// 一次等待的超时时间(ns)：取fd上设置的超时(ms)和当前协程截止时间的剩余预算中较小的一个，都没有设置时返回(uint64_t)-1
+static uint64_t wait_timeout(uint64_t timeout_ms)
+{
+    uint64_t timeout = (uint64_t)-1;
+    if(timeout_ms != (uint64_t)-1 && timeout_ms < (uint64_t)-1 / 1000000)
+    {
+        timeout = timeout_ms * 1000000;
+    }
+    return std::min(timeout, sylar::Fiber::GetDeadlineRemaining());
+}
+
+// 睡眠时间超过协程剩余预算时只睡到截止时间
+static std::chrono::nanoseconds clamp_to_deadline(std::chrono::nanoseconds timeout)
+{
+    uint64_t remaining = sylar::Fiber::GetDeadlineRemaining();
+    if(remaining != (uint64_t)-1 && timeout.count() > 0 && (uint64_t)timeout.count() > remaining)
+    {
+        return std::chrono::nanoseconds(remaining);
+    }
+    return timeout;
+}
+
+// 启用本次等待的超时定时器。
+// 等待记录保存在协程自身(Fiber::beginWait)，条件是协程的weak_ptr，回调只捕获原始值，可以放进TimerCallback的内联缓冲区，
+// 加上定时器对象池，事件先于超时到达的常见情况下整个超时路径不分配内存。
+// persistent为true时复用FdCtx中该方向的定时器，只重新设置超时时间；第一次使用时创建并保存下来
+static std::shared_ptr<sylar::Timer> arm_wait_timer(sylar::IOManager* iom, sylar::FdCtx* ctx, int timeout_so, bool persistent,
+                                                    const std::shared_ptr<sylar::Fiber>& fiber, uint64_t token, uint64_t timeout,
+                                                    int fd, sylar::IOManager::Event event)
+{
+    sylar::Fiber* f = fiber.get();
+    auto cb = [f, token, fd, iom, event]()
+    {
+        // 协程已经被事件唤醒，或者已经开始了下一次等待时CAS失败，直接返回
+        if(!f->timeoutWait(token))
+        {
+            return;
+        }
+        // cancel this event and trigger once to return to this fiber
+        // 只取消这个协程自己的等待并恢复它，同一fd上的其他等待者不受影响
+        iom->cancelWait(fd, event, f);
+    };
+
+    if(!persistent)
+    {
+        return iom->addConditionTimer(std::chrono::nanoseconds(timeout), cb, fiber);
+    }
+
+    std::shared_ptr<sylar::Timer>& timer = ctx->getTimeoutTimer(timeout_so);
+    if(timer && timer->getManagerId() == iom->getId())
+    {
+        timer->restart(std::chrono::nanoseconds(timeout), cb, fiber);
+        ctx->addTimerRearmed();
+    }
+    else
+    {
+        timer = iom->addConditionTimer(std::chrono::nanoseconds(timeout), cb, fiber);
+    }
+    return timer;
+}
+
+// 等待结束：停掉超时定时器，归还占用的持久定时器
+static void finish_wait(sylar::FdCtx* ctx, int timeout_so, bool persistent, const std::shared_ptr<sylar::Timer>& timer)
+{
+    if(timer)
+    {
+        timer->cancel();
+    }
+    if(persistent)
+    {
+        ctx->releaseTimeoutTimer(timeout_so);
+    }
+}
+
+// io_uring路径：把操作作为完成事件提交给IOManager的io_uring，协程挂起直到CQE到达。
+// 省去了"就绪通知 -> 重试系统调用 -> epoll_ctl重新注册"，多个协程的提交在idle中合并成一次io_uring_enter。
+// timeout_ms为fd上的超时时间，和协程截止时间取较小的一个。返回false表示无法提交(队列已满)，调用方继续走epoll路径
+static bool uring_io(sylar::IOManager* iom, const io_uring_sqe& sqe, uint64_t timeout_ms, ssize_t& n)
+{
+    uint64_t timeout = wait_timeout(timeout_ms);
+    if(timeout == 0) // 截止时间已过，不再提交
+    {
+        errno = ETIMEDOUT;
+        n = -1;
+        return true;
+    }
+
+    int res = 0;
+    if(!iom->uringSubmitAndWait(sqe, timeout, res))
+    {
+        return false;
+    }
+
+    if(res < 0)
+    {
+        // 被close()取消的操作，和关闭之后再调用一样返回EBADF
+        errno = res == -ECANCELED ? EBADF : -res;
+        n = -1;
+    }
+    else
+    {
+        n = res;
+    }
+    return true;
+}
+
+// 读写类hook的io_uring入口：只接管阻塞模式(对用户而言)的socket，其余情况返回false交给do_io
+static bool do_uring(int fd, int timeout_so, const io_uring_sqe& sqe, ssize_t& n)
+{
+    if(!sylar::t_hook_enable)
+    {
+        return false;
+    }
+
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!iom || !iom->hasUring())
+    {
+        return false;
+    }
+
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClosed() || !ctx->isSocket() || ctx->getUserNonblock())
+    {
+        return false;
+    }
+    return uring_io(iom, sqe, ctx->getTimeout(timeout_so), n);
+}
+
+// hook的系统调用新创建了fd：交给FdManager并初始化。nonblock为true时用户创建的就是非阻塞的fd(SOCK_NONBLOCK、O_NONBLOCK)，I/O不挂起
+static void track_fd(int fd, bool nonblock)
+{
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->create(fd);
+    if(ctx && nonblock)
+    {
+        ctx->setUserNonblock(true);
+    }
+}
+
+// fd将要被关闭，或者已经被dup2/dup3覆盖：唤醒在它上面等待的协程，从FdManager中移除。
+// 被覆盖时file_fd是仍然指向原来那个文件的副本，取消io_uring操作、恢复阻塞模式都要作用在原来的文件上
+static void release_fd(int fd, int file_fd = -1)
 {
-    int cancelled = 0; // 用于表示定时器是否已经被取消。
-};
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if(!ctx)
+    {
+        return;
+    }
+
+    auto iom = sylar::IOManager::GetThis();
+    if(iom)
+    {
+        iom->cancelAll(fd, file_fd);
+    }
+    // 把接管时设置的非阻塞模式还给共享同一打开文件的其他进程(比如管道另一端的子进程、终端)
+    ctx->restoreBlocking(file_fd);
+    // 定时器不再跟着这个fd号留下来，fd号被复用时不会用到别的IOManager的定时器
+    ctx->dropTimeoutTimers();
+    // del fdctx
+    sylar::FdMgr::GetInstance()->del(fd);
+}
+
+// dup2/dup3覆盖newfd之前：newfd被接管时复制一份，保住它原来的文件
+static int pin_replaced(int newfd)
+{
+    if(!sylar::FdMgr::GetInstance()->get(newfd))
+    {
+        return -1;
+    }
+    return fcntl_f(newfd, F_DUPFD_CLOEXEC, 0);
+}
+
+// dup2/dup3之后：成功时newfd原来的文件已经被隐式关闭，和close一样唤醒等待的协程、清理它的状态，再继承oldfd的状态。
+// 失败时(EBUSY、dup3的EINVAL等)newfd保持打开，状态原样保留
+static int finish_replace(int oldfd, int newfd, int pinned, int rt)
+{
+    int saved_errno = errno;
+    if(rt >= 0)
+    {
+        release_fd(newfd, pinned);
+        sylar::FdMgr::GetInstance()->dup(oldfd, rt);
+    }
+    if(pinned >= 0)
+    {
+        close_f(pinned);
+    }
+    errno = saved_errno;
+    return rt;
+}
+
+// 普通文件(以及块设备)：epoll不能等待它们，缺页或者磁盘慢时原始的系统调用会阻塞整个工作线程。
+// 返回应当走异步文件路径时使用的IOManager，fd不是这类文件、没有启用hook或者不在IOManager中时返回nullptr
+static sylar::IOManager* file_iom(int fd)
+{
+    if(!sylar::t_hook_enable)
+    {
+        return nullptr;
+    }
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!iom)
+    {
+        return nullptr;
+    }
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd, true);
+    if(!ctx || !ctx->isInit() || ctx->isClosed() || ctx->isPollable())
+    {
+        return nullptr;
+    }
+    return iom;
+}
+
+// 先用RWF_NOWAIT试一次：要读写的页都在页缓存中时直接完成(可能只完成一部分，和普通的短读短写一样)，协程不必挂起。
+// 需要等磁盘、或者内核和文件系统不支持时返回false，调用方再走异步路径。不支持的记在fd上，之后不再试
+static bool file_nowait(int fd, const struct iovec* iov, int iovcnt, off_t off, bool is_write, ssize_t& n)
+{
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if(ctx && ctx->isNowaitUnsupported())
+    {
+        return false;
+    }
+
+    n = is_write ? pwritev2(fd, iov, iovcnt, off, RWF_NOWAIT) : preadv2(fd, iov, iovcnt, off, RWF_NOWAIT);
+    if(n >= 0)
+    {
+        return true;
+    }
+    if(errno == EOPNOTSUPP || errno == EINVAL)
+    {
+        if(ctx)
+        {
+            ctx->setNowaitUnsupported();
+        }
+        return false;
+    }
+    return errno != EAGAIN;
+}
+
+// 先试着同步打开：用openat2的RESOLVE_CACHED只在dentry缓存中查找路径(O_PATH不真正打开，不会等待)，
+// 路径已经缓存、并且是普通文件或目录时，直接调用原始的open比交给io_uring或线程池便宜得多。
+// 创建和截断要写磁盘，FIFO和设备的打开可能要等对端，这些、路径不在缓存中以及内核不支持openat2时返回false，调用方走异步路径
+static bool open_nowait(const char* pathname, int flags, mode_t mode, int& fd)
+{
+    // 内核没有openat2(ENOSYS)或者不认识RESOLVE_CACHED(EINVAL)，之后不再尝试
+    static std::atomic<bool> s_unsupported = {false};
+    if(s_unsupported.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    if((flags & (O_CREAT | O_TRUNC)) || (flags & O_TMPFILE) == O_TMPFILE)
+    {
+        return false;
+    }
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_CLOEXEC | (flags & (O_NOFOLLOW | O_DIRECTORY));
+    how.resolve = RESOLVE_CACHED;
+    int probe = (int)syscall(__NR_openat2, AT_FDCWD, pathname, &how, sizeof(how));
+    if(probe < 0)
+    {
+        if(errno == ENOSYS || errno == EINVAL)
+        {
+            s_unsupported.store(true, std::memory_order_relaxed);
+        }
+        return false;
+    }
+    struct stat statbuf;
+    bool plain = fstat(probe, &statbuf) == 0 && (S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode));
+    close_f(probe);
+    if(!plain)
+    {
+        return false;
+    }
+
+    fd = open_f(pathname, flags, mode);
+    return true;
+}
+
+// 异步执行一次文件操作，当前协程挂起直到完成：有io_uring时作为完成事件提交(不设超时，文件I/O一旦开始就不能取消)，
+// 否则在IOManager的阻塞线程池中执行blocking(原始的系统调用)
+template<typename Blocking>
+static ssize_t file_io(sylar::IOManager* iom, const io_uring_sqe& sqe, Blocking blocking)
+{
+    int res = 0;
+    if(iom->hasUring() && iom->uringSubmitAndWait(sqe, (uint64_t)-1, res))
+    {
+        if(res < 0)
+        {
+            errno = res == -ECANCELED ? EBADF : -res;
+            return -1;
+        }
+        return res;
+    }
+
+    ssize_t n = -1;
+    int err = 0;
+    iom->runBlocking([&]()
+    {
+        n = blocking();
+        err = errno;
+    });
+    errno = err;
+    return n;
+}
+
+// 填写一个SQE，off为(uint64_t)-1表示使用文件当前的偏移
+static io_uring_sqe prep_sqe(uint8_t opcode, int fd, const void* addr, size_t len, uint64_t off)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)addr;
+    sqe.len = (uint32_t)std::min<size_t>(len, UINT32_MAX);
+    sqe.off = off;
+    return sqe;
+}
 
 // do_io的通用模板：
 // 可以发现项目代码中的：自定义的系统调用最后都将其参数放入do_io模板来做一个统一的规范化
@@ -94,10 +422,11 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    // 获取与文件描述符 fd 相关联的上下文 ctx。如果上下文不存在，则直接调用原始的 I/O 函数。
+    // 获取与文件描述符 fd 相关联的上下文 ctx。还没有接管的fd(比如没有经过hook创建的管道、eventfd)在这里接管，
+    // 由FdCtx::init判断能否用epoll等待。fd无效时上下文不存在，直接调用原始的 I/O 函数。
     // typedef Singleton<FdManager> FdMgr各位彦祖不要忘记了。
-    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
-    if(!ctx) // 如果在Fdmanager类中没找到相应的fd那就调用原始的系统调用
+    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd, true);
+    if(!ctx || !ctx->isInit()) // 如果在Fdmanager类中没找到相应的fd那就调用原始的系统调用
     {
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -108,17 +437,14 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
         return -1;
     }
 
-    // 如果文件描述符不是一个socket或者用户设置了非阻塞模式，则直接调用原始的I/O操作函数。
-    if(!ctx->isSocket() || ctx->getUserNonblock())
+    // 如果文件描述符不能用epoll等待(普通文件等)或者用户设置了非阻塞模式，则直接调用原始的I/O操作函数。
+    if(!ctx->isPollable() || ctx->getUserNonblock())
     {
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    // get the timeout
-    // 获取超时设置并初始化timer_info结构体，用于后续的超时管理和取消操作。
-    uint64_t timeout = ctx->getTimeout(timeout_so);
-    // timer condition
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    // 是否被就绪事件唤醒过，WAKE_ONE时这次I/O结束后(不论成功还是出错)要把就绪交给下一个等待者
+    bool woken = false;
 
     // 调用原始的I/O函数，如果由于系统中断（EINTR）导致操作失败，函数会重试。
 retry:
@@ -136,64 +462,75 @@ retry:
     if(n == -1 && errno == EAGAIN)
     {
         sylar::IOManager* iom = sylar::IOManager::GetThis();
+        std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
         // timer
         std::shared_ptr<sylar::Timer> timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
+        bool persistent = false; // 是否占用了fd上的持久定时器
+        uint64_t token = fiber->beginWait();
 
         // 1 timeout has been set -> add a conditional timer for canceling this operation
-        // 如果执行的read等函数在Fdmanager管理的Fdctx中fd设置了超时时间，就会走到这里。添加addconditionTimer事件
+        // 如果执行的read等函数在Fdmanager管理的Fdctx中fd设置了超时时间，或者当前协程设置了截止时间，就会走到这里。添加addconditionTimer事件
+        // 每次等待都重新计算，协程的剩余预算会随着多次重试不断减少
+        uint64_t timeout = wait_timeout(ctx->getTimeout(timeout_so));
+        if(timeout == 0) // 截止时间已过，不再等待
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
         if(timeout != (uint64_t)-1)
         {
-            timer = iom->addConditionTimer(timeout, [winfo, fd, iom, event]()
-            {
-                auto t = winfo.lock();
-                if(!t || t->cancelled) // 如果 timer_info 对象已被释放（!t），或者操作已被取消（t->cancelled 非 0），则直接返回。
-                {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT; // 如果超时时间到达并且事件尚未被处理(即cancelled任然是0)；
-                // cancel this event and trigger once to return to this fiber
-                // 取消该文件描述符上的事件，并立即触发一次事件（即恢复被挂起的协程）
-                iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
-            }, winfo);
+            persistent = ctx->acquireTimeoutTimer(timeout_so);
+            timer = arm_wait_timer(iom, ctx, timeout_so, persistent, fiber, token, timeout, fd, (sylar::IOManager::Event)(event));
         }
 
         // 2 add event -> callback is this fiber
         // 这行代码的作用是将 fd（文件描述符）和 event（要监听的事件，如读或写事件）添加到 IOManager 中进行管理。IOManager 会监听这个文件描述符上的事件，当事件触发时，它会调度相应的协程来处理这个事件。
         int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
-        if(rt)
+        if(rt == 1)
+        {
+            // 持久注册模式下fd在等待之前已经就绪，不挂起，直接重试
+            finish_wait(ctx, timeout_so, persistent, timer);
+            goto retry;
+        }
+        else if(rt)
         {
             std::cout << hook_fun_name << " addEvent("<< fd << ", " << event << ")";
-            if(timer) // 如果 rt 为-1，说明 addEvent 失败。此时，会打印一条调试信息，并且因为添加事件失败所以要取消之前设置的定时器，避免误触发。
-            {
-                timer->cancel();
-            }
+            // 如果 rt 为-1，说明 addEvent 失败。此时，会打印一条调试信息，并且因为添加事件失败所以要取消之前设置的定时器，避免误触发。
+            finish_wait(ctx, timeout_so, persistent, timer);
             return -1;
         }
         else // 如果 addEvent 成功（rt 为 0），当前协程会调用 yield() 函数，将自己挂起，等待事件的触发。
         {
-            sylar::Fiber::GetThis()->yield();
+            fiber->yield();
 
             // 3 resume either by addEvent or cancelEvent
             // 当协程被恢复时（例如，事件触发后），它会继续执行 yield() 之后的代码。
             // 如果之前设置了定时器（timer 不为 nullptr），则在事件处理完毕后取消该定时器。
             // 取消定时器的原因是，该定时器的唯一目的是在 I/O 操作超时时取消事件。如果事件已经正常处理完毕，那么定时器就不再需要了。
-            if(timer)
-            {
-                timer->cancel();
-            }
+            finish_wait(ctx, timeout_so, persistent, timer);
             // by cancelEvent
-            // 接下来检查 tinfo->cancelled 是否等于 ETIMEDOUT。
-            // 如果等于，说明该操作因超时而被取消，因此设置 errno 为 ETIMEDOUT 并返回 -1，表示操作失败。
-            if(tinfo->cancelled == ETIMEDOUT)
+            // 接下来检查这次等待是否被超时定时器标记。
+            // 如果是，说明该操作因超时而被取消，因此设置 errno 为 ETIMEDOUT 并返回 -1，表示操作失败。
+            if(fiber->waitTimedOut())
             {
-                errno = tinfo->cancelled;
+                ctx->addTimerFired();
+                errno = ETIMEDOUT;
                 return -1;
             }
             // 如果没有超时，则跳转到 retry 标签，重新尝试这个操作。
+            woken = true;
             goto retry;
         }
     }
+
+    // 走到这里结果已经不是EAGAIN：出错(例如ECONNRESET)时就绪状态同样被这次唤醒消耗了，
+    // 不交出去的话其他等待者要等到下一个边缘才会被唤醒
+    if(woken)
+    {
+        int saved_errno = errno;
+        sylar::IOManager::GetThis()->rearmEvent(fd, (sylar::IOManager::Event)(event));
+        errno = saved_errno;
+    }
     return n;
 }
 
@@ -215,15 +552,18 @@ extern "C"{
 		    return sleep_f(seconds);
 	    }
 
+	    // 受协程截止时间约束，被截断时和被信号打断一样返回没有睡完的秒数
+	    std::chrono::nanoseconds timeout = clamp_to_deadline(std::chrono::seconds(seconds));
+	    unsigned int unslept = seconds - std::chrono::duration_cast<std::chrono::seconds>(timeout).count();
+
 	    // 获取当前正在执行的协程（Fiber），并将其保存到 fiber 变量中。
 	    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
 	    sylar::IOManager* iom = sylar::IOManager::GetThis();
 	    // add a timer to reschedule this fiber
-	    // sleep*1000是转换微秒。
-	    iom->addTimer(seconds*1000, [fiber, iom](){iom->scheduleLock(fiber, -1);});
+	    iom->addTimer(timeout, [fiber, iom](){iom->scheduleLock(fiber, -1);});
 	    // wait for the next resume
 	    fiber->yield(); // 挂起当前协程的执行，将控制权交还给调度器。
-	    return 0;
+	    return unslept;
     }
 
     // useconds_t一个无符号整数类型，通常用于表示微秒数。
@@ -237,10 +577,16 @@ extern "C"{
 	    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
 	    sylar::IOManager* iom = sylar::IOManager::GetThis();
 	    // add a timer to reschedule this fiber
-	    // usec表示延时的微秒数，将其转换为毫秒数(usec/1000)后用于定时器。
-	    iom->addTimer(usec/1000, [fiber, iom](){iom->scheduleLock(fiber);});
+	    // usec表示延时的微秒数，定时器支持纳秒精度，不再截断成毫秒。
+	    std::chrono::nanoseconds timeout = clamp_to_deadline(std::chrono::microseconds(usec));
+	    iom->addTimer(timeout, [fiber, iom](){iom->scheduleLock(fiber);});
 	    // wait for the next resume
 	    fiber->yield();
+	    if(timeout < std::chrono::microseconds(usec)) // 被截止时间截断
+	    {
+	        errno = EINTR;
+	        return -1;
+	    }
 	    return 0;
     }
 
@@ -252,15 +598,27 @@ extern "C"{
 		    return nanosleep_f(req, rem);
 	    }
 
-	    // timeout_ms 将 tv_sec 转换为毫秒，并将 tv_nsec 转换为毫秒，然后两者相加得到总的超时毫秒数。所以从这里看出实现的也是一个毫秒级的操作。
-	    int timeout_ms = req->tv_sec*1000 + req->tv_nsec/1000/1000;
+	    // 将 tv_sec 和 tv_nsec 合成纳秒，保留亚毫秒精度。
+	    std::chrono::nanoseconds request = std::chrono::seconds(req->tv_sec) + std::chrono::nanoseconds(req->tv_nsec);
+	    std::chrono::nanoseconds timeout = clamp_to_deadline(request);
 
 	    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
 	    sylar::IOManager* iom = sylar::IOManager::GetThis();
 	    // add a timer to reschedule this fiber
-	    iom->addTimer(timeout_ms, [fiber, iom](){iom->scheduleLock(fiber, -1);});
+	    iom->addTimer(timeout, [fiber, iom](){iom->scheduleLock(fiber, -1);});
 	    // wait for the next resume
 	    fiber->yield();
+	    if(timeout < request) // 被截止时间截断，rem中返回没有睡完的时间
+	    {
+	        if(rem)
+	        {
+	            std::chrono::nanoseconds left = request - timeout;
+	            rem->tv_sec = std::chrono::duration_cast<std::chrono::seconds>(left).count();
+	            rem->tv_nsec = (left - std::chrono::seconds(rem->tv_sec)).count();
+	        }
+	        errno = EINTR;
+	        return -1;
+	    }
 	    return 0;
     }
 
@@ -279,7 +637,7 @@ extern "C"{
 		    return fd;
 	    }
 	    // 如果socket创建成功会利用Fdmanager的文件描述符管理类来进行管理，判断是否在其管理的文件描述符中，如果不在扩展存储文件描述数组大小，并且利用FDctx进行初始化判断是是不是套接字，是不是系统非阻塞模式。
-	    sylar::FdMgr::GetInstance()->get(fd, true);
+	    track_fd(fd, type & SOCK_NONBLOCK);
 	    return fd;
     }
 
@@ -293,7 +651,7 @@ extern "C"{
             return connect_f(fd, addr, addrlen);
         }
 
-        std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+        sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
         if(!ctx || ctx->isClosed()) // 检查文件描述符上下文是否存在或是否已关闭。
         {
             errno = EBADF; // EBADF表示一个无效的文件描述符
@@ -313,6 +671,16 @@ extern "C"{
             return connect_f(fd, addr, addrlen);
         }
 
+        // io_uring模式下connect也作为完成事件提交，内核在连接建立或失败时直接给出结果
+        {
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            ssize_t n;
+            if(iom && iom->hasUring() && uring_io(iom, prep_sqe(IORING_OP_CONNECT, fd, addr, 0, addrlen), timeout_ms, n))
+            {
+                return (int)n;
+            }
+        }
+
         // attempt to connect
         int n = connect_f(fd, addr, addrlen); // 尝试进行 connect 操作，返回值存储在 n 中。
         if(n == 0)
@@ -327,27 +695,26 @@ extern "C"{
         // wait for write event is ready -> connect succeeds
 	    sylar::IOManager* iom = sylar::IOManager::GetThis(); // 获取当前线程的 IOManager 实例。
 	    std::shared_ptr<sylar::Timer> timer; // 声明一个定时器对象。
-	    std::shared_ptr<timer_info> tinfo(new timer_info); // 创建追踪定时器是否取消的对象
-	    std::weak_ptr<timer_info> winfo(tinfo); // 判断追踪定时器对象是否存在
+	    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
+	    uint64_t token = fiber->beginWait(); // 这次等待的标记，超时定时器用它通知协程
 
-        if(timeout_ms != (uint64_t)-1) // 检查是否设置了超时时间。如果 timeout_ms 不等于 -1，则创建一个定时器。
+        // 取timeout_ms和协程剩余预算中较小的一个
+        uint64_t timeout = wait_timeout(timeout_ms);
+        if(timeout == 0)
         {
-            timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]()
-            {
-                auto t = winfo.lock();
-                if(!t || t->cancelled)
-                {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, sylar::IOManager::WRITE);
-            }, winfo);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if(timeout != (uint64_t)-1) // 检查是否设置了超时时间。如果不等于 -1，则创建一个定时器。
+        {
+            // 一个fd只connect一次，不需要复用持久定时器
+            timer = arm_wait_timer(iom, ctx, SO_SNDTIMEO, false, fiber, token, timeout, fd, sylar::IOManager::WRITE);
         }
 
         int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
         if(rt == 0)
         {
-            sylar::Fiber::GetThis()->yield();
+            fiber->yield();
 
             // resume either by addEvent or cancelEvent
             if(timer)
@@ -355,9 +722,9 @@ extern "C"{
                 timer->cancel();
             }
 
-            if(tinfo->cancelled)
+            if(fiber->waitTimedOut())
             {
-                errno = tinfo->cancelled;
+                errno = ETIMEDOUT;
                 return -1;
             }
         }
@@ -367,7 +734,11 @@ extern "C"{
             {
                 timer->cancel();
             }
-            std::cerr << "connect addEvent(" << fd << ", WRITE) error";
+            // rt为1时连接已经完成(持久注册模式下的就绪事件)，直接检查结果
+            if(rt != 1)
+            {
+                std::cerr << "connect addEvent(" << fd << ", WRITE) error";
+            }
         }
 
         // check out if the connection socket established
@@ -401,26 +772,96 @@ extern "C"{
     // 并且如果成功接收了一个新的连接，则将新的文件描述符fd添加到文件描述符管理器(FdManager)中进行跟踪管理。
     int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     {
-	    int fd = do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_ACCEPT, sockfd, addr, 0, 0);
+	    sqe.addr2 = (uint64_t)addrlen;
+	    int fd = do_uring(sockfd, SO_RCVTIMEO, sqe, n) ? (int)n
+	             : do_io(sockfd, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+	    if(fd>=0)
+	    {
+		    sylar::FdMgr::GetInstance()->create(fd);
+	    }
+	    return fd;
+    }
+
+    // 和accept一样，flags中的SOCK_NONBLOCK表示用户要非阻塞的新连接
+    int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+    {
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_ACCEPT, sockfd, addr, 0, 0);
+	    sqe.addr2 = (uint64_t)addrlen;
+	    sqe.accept_flags = flags;
+	    int fd = do_uring(sockfd, SO_RCVTIMEO, sqe, n) ? (int)n
+	             : do_io(sockfd, accept4_f, "accept4", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen, flags);
 	    if(fd>=0)
 	    {
-		    sylar::FdMgr::GetInstance()->get(fd, true);
+		    track_fd(fd, flags & SOCK_NONBLOCK);
 	    }
 	    return fd;
     }
 
+    int socketpair(int domain, int type, int protocol, int sv[2])
+    {
+	    if(!sylar::t_hook_enable)
+	    {
+		    return socketpair_f(domain, type, protocol, sv);
+	    }
+
+	    int rt = socketpair_f(domain, type, protocol, sv);
+	    if(rt == 0)
+	    {
+		    track_fd(sv[0], type & SOCK_NONBLOCK);
+		    track_fd(sv[1], type & SOCK_NONBLOCK);
+	    }
+	    return rt;
+    }
+
     ssize_t read(int fd, void *buf, size_t count)
     {
+	    ssize_t n;
+	    if(do_uring(fd, SO_RCVTIMEO, prep_sqe(IORING_OP_READ, fd, buf, count, (uint64_t)-1), n))
+	    {
+		    return n;
+	    }
+	    if(sylar::IOManager* iom = file_iom(fd))
+	    {
+		    struct iovec iov = {buf, count};
+		    if(file_nowait(fd, &iov, 1, -1, false, n))
+		    {
+			    return n;
+		    }
+		    return file_io(iom, prep_sqe(IORING_OP_READ, fd, buf, count, (uint64_t)-1), [=]() { return read_f(fd, buf, count); });
+	    }
 	    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
     }
 
     ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
     {
+	    ssize_t n;
+	    if(do_uring(fd, SO_RCVTIMEO, prep_sqe(IORING_OP_READV, fd, iov, iovcnt, (uint64_t)-1), n))
+	    {
+		    return n;
+	    }
+	    if(sylar::IOManager* iom = file_iom(fd))
+	    {
+		    if(file_nowait(fd, iov, iovcnt, -1, false, n))
+		    {
+			    return n;
+		    }
+		    return file_io(iom, prep_sqe(IORING_OP_READV, fd, iov, iovcnt, (uint64_t)-1), [=]() { return readv_f(fd, iov, iovcnt); });
+	    }
 	    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
     }
 
     ssize_t recv(int sockfd, void *buf, size_t len, int flags)
     {
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_RECV, sockfd, buf, len, 0);
+	    sqe.msg_flags = flags;
+	    if(do_uring(sockfd, SO_RCVTIMEO, sqe, n))
+	    {
+		    return n;
+	    }
 	    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
     }
 
@@ -431,21 +872,62 @@ extern "C"{
 
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
     {
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_RECVMSG, sockfd, msg, 1, 0);
+	    sqe.msg_flags = flags;
+	    if(do_uring(sockfd, SO_RCVTIMEO, sqe, n))
+	    {
+		    return n;
+	    }
 	    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
     }
 
     ssize_t write(int fd, const void *buf, size_t count)
     {
+	    ssize_t n;
+	    if(do_uring(fd, SO_SNDTIMEO, prep_sqe(IORING_OP_WRITE, fd, buf, count, (uint64_t)-1), n))
+	    {
+		    return n;
+	    }
+	    if(sylar::IOManager* iom = file_iom(fd))
+	    {
+		    struct iovec iov = {const_cast<void*>(buf), count};
+		    if(file_nowait(fd, &iov, 1, -1, true, n))
+		    {
+			    return n;
+		    }
+		    return file_io(iom, prep_sqe(IORING_OP_WRITE, fd, buf, count, (uint64_t)-1), [=]() { return write_f(fd, buf, count); });
+	    }
 	    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
     }
 
     ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
     {
+	    ssize_t n;
+	    if(do_uring(fd, SO_SNDTIMEO, prep_sqe(IORING_OP_WRITEV, fd, iov, iovcnt, (uint64_t)-1), n))
+	    {
+		    return n;
+	    }
+	    if(sylar::IOManager* iom = file_iom(fd))
+	    {
+		    if(file_nowait(fd, iov, iovcnt, -1, true, n))
+		    {
+			    return n;
+		    }
+		    return file_io(iom, prep_sqe(IORING_OP_WRITEV, fd, iov, iovcnt, (uint64_t)-1), [=]() { return writev_f(fd, iov, iovcnt); });
+	    }
 	    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
     }
 
     ssize_t send(int sockfd, const void *buf, size_t len, int flags)
     {
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_SEND, sockfd, buf, len, 0);
+	    sqe.msg_flags = flags;
+	    if(do_uring(sockfd, SO_SNDTIMEO, sqe, n))
+	    {
+		    return n;
+	    }
 	    return do_io(sockfd, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, len, flags);
     }
 
@@ -456,6 +938,13 @@ extern "C"{
 
     ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
     {
+	    ssize_t n;
+	    io_uring_sqe sqe = prep_sqe(IORING_OP_SENDMSG, sockfd, msg, 1, 0);
+	    sqe.msg_flags = flags;
+	    if(do_uring(sockfd, SO_SNDTIMEO, sqe, n))
+	    {
+		    return n;
+	    }
 	    return do_io(sockfd, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
     }
 
@@ -468,19 +957,152 @@ extern "C"{
 		    return close_f(fd);
 	    }
 
-	    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+	    release_fd(fd);
+	    return close_f(fd);
+    }
 
-	    if(ctx)
+    int pipe(int pipefd[2])
+    {
+	    if(!sylar::t_hook_enable)
 	    {
-		    auto iom = sylar::IOManager::GetThis();
-		    if(iom)
-		    {
-			    iom->cancelAll(fd);
-		    }
-		    // del fdctx
-		    sylar::FdMgr::GetInstance()->del(fd);
+		    return pipe_f(pipefd);
 	    }
-	    return close_f(fd);
+
+	    int rt = pipe_f(pipefd);
+	    if(rt == 0)
+	    {
+		    track_fd(pipefd[0], false);
+		    track_fd(pipefd[1], false);
+	    }
+	    return rt;
+    }
+
+    int pipe2(int pipefd[2], int flags)
+    {
+	    if(!sylar::t_hook_enable)
+	    {
+		    return pipe2_f(pipefd, flags);
+	    }
+
+	    int rt = pipe2_f(pipefd, flags);
+	    if(rt == 0)
+	    {
+		    track_fd(pipefd[0], flags & O_NONBLOCK);
+		    track_fd(pipefd[1], flags & O_NONBLOCK);
+	    }
+	    return rt;
+    }
+
+    int dup(int oldfd)
+    {
+	    if(!sylar::t_hook_enable)
+	    {
+		    return dup_f(oldfd);
+	    }
+
+	    int fd = dup_f(oldfd);
+	    if(fd >= 0)
+	    {
+		    sylar::FdMgr::GetInstance()->dup(oldfd, fd);
+	    }
+	    return fd;
+    }
+
+    int dup2(int oldfd, int newfd)
+    {
+	    if(!sylar::t_hook_enable || oldfd == newfd)
+	    {
+		    return dup2_f(oldfd, newfd);
+	    }
+
+	    int pinned = pin_replaced(newfd);
+	    return finish_replace(oldfd, newfd, pinned, dup2_f(oldfd, newfd));
+    }
+
+    int dup3(int oldfd, int newfd, int flags)
+    {
+	    if(!sylar::t_hook_enable || oldfd == newfd) // oldfd == newfd时dup3返回EINVAL
+	    {
+		    return dup3_f(oldfd, newfd, flags);
+	    }
+
+	    int pinned = pin_replaced(newfd);
+	    return finish_replace(oldfd, newfd, pinned, dup3_f(oldfd, newfd, flags));
+    }
+
+    // 打开文件不经过epoll：路径查找和读inode都可能等磁盘，打开FIFO还会等对端，所以和文件读写一样先试同步，不行再异步执行
+    int open(const char *pathname, int flags, ... /* mode_t mode */)
+    {
+	    mode_t mode = 0;
+	    if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) // 只有创建文件时才有第三个参数
+	    {
+		    va_list va;
+		    va_start(va, flags);
+		    mode = va_arg(va, mode_t);
+		    va_end(va);
+	    }
+
+	    sylar::IOManager* iom = sylar::t_hook_enable ? sylar::IOManager::GetThis() : nullptr;
+	    if(!iom)
+	    {
+		    return open_f(pathname, flags, mode);
+	    }
+
+	    int fd;
+	    if(!open_nowait(pathname, flags, mode, fd))
+	    {
+		    io_uring_sqe sqe = prep_sqe(IORING_OP_OPENAT, AT_FDCWD, pathname, mode, 0);
+		    sqe.open_flags = flags;
+		    fd = file_io(iom, sqe, [=]() { return open_f(pathname, flags, mode); });
+	    }
+	    if(fd >= 0)
+	    {
+		    track_fd(fd, flags & O_NONBLOCK); // O_NONBLOCK时用户要的就是非阻塞的FIFO/设备
+	    }
+	    return fd;
+    }
+
+    ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+    {
+	    sylar::IOManager* iom = file_iom(fd);
+	    if(!iom)
+	    {
+		    return pread_f(fd, buf, count, offset);
+	    }
+	    ssize_t n;
+	    struct iovec iov = {buf, count};
+	    if(file_nowait(fd, &iov, 1, offset, false, n))
+	    {
+		    return n;
+	    }
+	    return file_io(iom, prep_sqe(IORING_OP_READ, fd, buf, count, offset), [=]() { return pread_f(fd, buf, count, offset); });
+    }
+
+    ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+    {
+	    sylar::IOManager* iom = file_iom(fd);
+	    if(!iom)
+	    {
+		    return pwrite_f(fd, buf, count, offset);
+	    }
+	    ssize_t n;
+	    struct iovec iov = {const_cast<void*>(buf), count};
+	    if(file_nowait(fd, &iov, 1, offset, true, n))
+	    {
+		    return n;
+	    }
+	    return file_io(iom, prep_sqe(IORING_OP_WRITE, fd, buf, count, offset), [=]() { return pwrite_f(fd, buf, count, offset); });
+    }
+
+    // 刷盘总是要等磁盘，直接异步执行
+    int fsync(int fd)
+    {
+	    sylar::IOManager* iom = file_iom(fd);
+	    if(!iom)
+	    {
+		    return fsync_f(fd);
+	    }
+	    return file_io(iom, prep_sqe(IORING_OP_FSYNC, fd, nullptr, 0, 0), [=]() { return fsync_f(fd); });
     }
 
     // 操作文件描述符的系统调用，可以执行多种操作，比如设置文件描述符状态，锁定文件等。
@@ -496,8 +1118,8 @@ extern "C"{
                 {
                     int arg = va_arg(va, int); // Access the next int argument
                     va_end(va);
-                    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
-                    if(!ctx || ctx->isClosed() || !ctx->isSocket())
+                    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+                    if(!ctx || ctx->isClosed() || !ctx->isPollable())
                     {
                         return fcntl_f(fd, cmd, arg);
                     }
@@ -520,8 +1142,8 @@ extern "C"{
                 {
                     va_end(va);
                     int arg = fcntl_f(fd, cmd);
-                    std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
-                    if(!ctx || ctx->isClosed() || !ctx->isSocket())
+                    sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
+                    if(!ctx || ctx->isClosed() || !ctx->isPollable())
                     {
                         return arg;
                     }
@@ -539,6 +1161,18 @@ extern "C"{
 
             case F_DUPFD:
             case F_DUPFD_CLOEXEC:
+                {
+                    int arg = va_arg(va, int);
+                    va_end(va);
+                    int newfd = fcntl_f(fd, cmd, arg);
+                    if(newfd >= 0 && sylar::t_hook_enable)
+                    {
+                        sylar::FdMgr::GetInstance()->dup(fd, newfd); // 和dup一样，副本继承原fd的状态
+                    }
+                    return newfd;
+                }
+                break;
+
             case F_SETFD:
             case F_SETOWN:
             case F_SETSIG:
@@ -609,9 +1243,9 @@ extern "C"{
         {
             // ！！是为了保证明确的将其转为成一个bool类型，比如一开始结果是true，经过一次!转换成了false，然后！再一次转换成了true；
             bool user_nonblock = !!*(int*)arg; // 当前 ioctl 调用是为了设置或清除非阻塞模式。
-            std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
+            sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(fd);
             // 检查获取的上下文对象是否有效（即 ctx 是否为空）。如果上下文对象无效、文件描述符已关闭或不是一个套接字，则直接调用原始的 ioctl 函数，返回处理结果。
-            if(!ctx || ctx->isClosed() || !ctx->isSocket())
+            if(!ctx || ctx->isClosed() || !ctx->isPollable())
             {
                 return ioctl_f(fd, request, arg);
             }
@@ -644,7 +1278,7 @@ extern "C"{
         {
             if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)
             {
-                std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(sockfd);
+                sylar::FdCtx* ctx = sylar::FdMgr::GetInstance()->get(sockfd);
                 if(ctx)
                 {	// 那么代码会读取传入的 timeval 结构体，将其转化为毫秒数，并调用 ctx->setTimeout 方法，记录超时设置：
                     const timeval* v = (const timeval*)optval;
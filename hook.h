@@ -40,6 +40,27 @@ extern "C" // 确保正确调用C库中的系统调用，C++编译器不会对
 	typedef int (*accept_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 	extern accept_fun accept_f;
 
+	typedef int (*accept4_fun) (int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+	extern accept4_fun accept4_f;
+
+	typedef int (*socketpair_fun) (int domain, int type, int protocol, int sv[2]);
+	extern socketpair_fun socketpair_f;
+
+	typedef int (*pipe_fun) (int pipefd[2]);
+	extern pipe_fun pipe_f;
+
+	typedef int (*pipe2_fun) (int pipefd[2], int flags);
+	extern pipe2_fun pipe2_f;
+
+	typedef int (*dup_fun) (int oldfd);
+	extern dup_fun dup_f;
+
+	typedef int (*dup2_fun) (int oldfd, int newfd);
+	extern dup2_fun dup2_f;
+
+	typedef int (*dup3_fun) (int oldfd, int newfd, int flags);
+	extern dup3_fun dup3_f;
+
 	typedef ssize_t (*read_fun) (int fd, void *buf, size_t count);
 	extern read_fun read_f;
 
@@ -73,6 +94,18 @@ extern "C" // 确保正确调用C库中的系统调用，C++编译器不会对
 	typedef int (*close_fun) (int fd);
 	extern close_fun close_f;
 
+	typedef int (*open_fun) (const char *pathname, int flags, ... /* mode_t mode */);
+	extern open_fun open_f;
+
+	typedef ssize_t (*pread_fun) (int fd, void *buf, size_t count, off_t offset);
+	extern pread_fun pread_f;
+
+	typedef ssize_t (*pwrite_fun) (int fd, const void *buf, size_t count, off_t offset);
+	extern pwrite_fun pwrite_f;
+
+	typedef int (*fsync_fun) (int fd);
+	extern fsync_fun fsync_f;
+
 	typedef int (*fcntl_fun) (int fd, int cmd, ... /* arg */ );
 	extern fcntl_fun fcntl_f;
 
@@ -97,6 +130,8 @@ extern "C" // 确保正确调用C库中的系统调用，C++编译器不会对
 	int socket(int domain, int type, int protocol);
 	int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 	int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+	int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+	int socketpair(int domain, int type, int protocol, int sv[2]);
 
 	// read 
 	ssize_t read(int fd, void *buf, size_t count);
@@ -116,6 +151,19 @@ extern "C" // 确保正确调用C库中的系统调用，C++编译器不会对
 
     // fd
     int close(int fd);
+    // 创建的fd都交给FdManager，和socket()一样参与协程调度；副本继承原fd的状态
+    int pipe(int pipefd[2]);
+    int pipe2(int pipefd[2], int flags);
+    int dup(int oldfd);
+    int dup2(int oldfd, int newfd);
+    int dup3(int oldfd, int newfd, int flags);
+
+    // file
+    // 普通文件的I/O：页缓存命中时直接完成，否则协程挂起，由io_uring或IOManager的阻塞线程池完成
+    int open(const char *pathname, int flags, ... /* mode_t mode */);
+    ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+    ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+    int fsync(int fd);
 
     // socket control
     int fcntl(int fd, int cmd, ... /* arg */ );
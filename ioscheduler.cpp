@@ -1,72 +1,103 @@
 #include <unistd.h>    
 #include <sys/epoll.h> 
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>     
+#include <sys/socket.h>
 #include <cstring>
+#include <deque>
+#include <algorithm>
 
 #include "ioscheduler.h"
+#include "hook.h"
+#include "uring.h"
 
 static bool debug = true;
 
 namespace sylar {
 
-    IOManager* IOManager::GetThis()
+    // io_uring的队列长度，以及攒够多少个SQE就不再等到idle而是立即提交
+    static const unsigned URING_ENTRIES = 256;
+    static const unsigned URING_BATCH = 32;
+    // 完成队列的长度：每个multishot请求都可能随时产生完成事件，比提交队列长得多
+    static const unsigned URING_CQ_ENTRIES = 4096;
+    // multishot recv共享缓冲池的组号、缓冲区个数和大小
+    static const uint16_t URING_BUF_GROUP = 0;
+    static const unsigned URING_BUF_COUNT = 1024;
+    static const unsigned URING_BUF_SIZE = 4096;
+    // multishot请求的user_data指向UringStream并置最低位，与指向UringWaiter的单次请求区分
+    static const uint64_t URING_MULTISHOT_TAG = 1;
+    // 链接超时的user_data指向它所属操作的UringWaiter并置第二位，完成事件的res为-ETIME表示超时到期
+    static const uint64_t URING_TIMEOUT_TAG = 2;
+    // runBlocking线程池的线程数
+    static const size_t BLOCKING_THREADS = 4;
+
+    // 忙轮询模式：每轮询这么多次合并一次统计并让出做一次完整的检查；socket上SO_BUSY_POLL的忙等时间(us)
+    static const uint64_t BUSY_POLL_CHECK = 1024;
+    static const int BUSY_POLL_USEC = 50;
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+    // 让内核在这个socket上忙等网卡队列而不是等中断。不是socket或者没有权限时忽略
+    static void enableBusyPoll(int fd)
     {
-        return dynamic_cast<IOManager*>(Scheduler::GetThis());
+        int usec = BUSY_POLL_USEC;
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+        int prefer = 1;
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
     }
 
-    // 根据传入的事件event，返回对应事件上下文的引用。
-    IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(Event event)
+    // 统计用的时间戳(steady_clock纳秒)
+    static uint64_t NowNs()
     {
-        assert(event==READ || event==WRITE); // 判断事件要么是读事件，或者写事件
-        switch (event)
-        {
-        case READ:
-            return read;
-        case WRITE:
-            return write;
-        }
-        throw std::invalid_argument("Unsupported event type");
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
     }
 
-    // 重置EventContext事件的上下文，将其恢复到初始或者空的状态。主要作用是清理并重置传入的 EventContext 对象，使其不再与任何调度器、线程或回调函数相关联。
-    void IOManager::FdContext::resetEventContext(EventContext &ctx)
+    // 一次io_uring操作的等待记录。放在发起操作的协程栈上：协程在操作完成之前一直挂起，栈上的数据始终有效，
+    // SQE的user_data直接指向它，不需要额外分配
+    struct UringWaiter
     {
-        ctx.scheduler = nullptr;
-        ctx.fiber.reset();
-        ctx.cb = nullptr;
-    }
-
-    // 函数负责在指定的 IO 事件被触发时，执行相应的回调函数或线程，并且在执行完之后清理相关的事件上下文。
-    // no lock
-    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
-        assert(events & event); // 确保event是中有指定的事件，否则程序中断。
-
-        // delete event
-        // 清理该事件，表示不再关注，也就是说，注册IO事件是一次性的，
-        // 如果想持续关注某个Socket fd的读写事件，那么每次触发事件后都要重新添加
-        events = (Event)(events & ~event); // 对标志位取反再相加就是相当于将event从events中删除
-
-        // trigger
-        // 这个过程就相当于scheduler文件中的main.cc测试一样，把真正要执行的函数放入到任务队列中等线程取出后任务后，协程执行，执行完成后返回主协程继续，执行run方法取任务执行任务(不过可能是不同的线程的协程执行了)。
-        EventContext& ctx = getEventContext(event);
-        if (ctx.cb)
-        {
-            // call ScheduleTask(std::function<void()>* f, int thr)
-            ctx.scheduler->scheduleLock(&ctx.cb);
-        }
-        else
-        {
-            // call ScheduleTask(std::shared_ptr<Fiber>* f, int thr)
-            ctx.scheduler->scheduleLock(&ctx.fiber);
-        }
+        std::shared_ptr<Fiber> fiber;
+        Scheduler* scheduler = nullptr;
+        int res = 0;
+        // 还没有收到的完成事件数。带超时时操作和链接的超时各产生一个，两个都收到之后才恢复协程，此后waiter随栈失效
+        int pending = 1;
+        // 链接的超时到期了：操作因此以-ECANCELED结束，而不是被close取消
+        bool timedOut = false;
+    };
+
+    // 一个multishot请求产生的完成事件流，挂在FdCtx::multishot上。请求还在内核中时self持有自己，
+    // 最后一个完成事件(没有IORING_CQE_F_MORE)释放它，之后的等待重新提交请求
+    struct UringStream
+    {
+        std::mutex mutex;
+        uint8_t opcode = 0;
+        const IOManager* manager = nullptr;
+        // 还没有被取走的结果(res, flags)
+        std::deque<std::pair<int, uint32_t>> results;
+        // 挂起等待结果的协程
+        std::shared_ptr<Fiber> fiber;
+        Scheduler* scheduler = nullptr;
+        std::shared_ptr<UringStream> self;
+        // fd已经close，之后没人取走的结果直接丢弃
+        bool closed = false;
+    };
+
+    // 当前线程绑定的每线程epoll实例
+    static thread_local IOManager* t_poller_manager = nullptr;
+    static thread_local int t_poller = -1;
 
-        // reset event context
-        resetEventContext(ctx);
-        return;
+    IOManager* IOManager::GetThis()
+    {
+        return dynamic_cast<IOManager*>(Scheduler::GetThis());
     }
 
-    IOManager::IOManager(size_t threads, bool use_caller, const std::string &name):
-    Scheduler(threads, use_caller, name), TimerManager()
+    IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, int mode):
+    Scheduler(threads, use_caller, name), TimerManager(threads + 1), // 每个工作线程一个定时器分片，外加一个共享分片
+    m_mode(mode)
     {
         // create epoll fd
         m_epfd = epoll_create(5000);
@@ -74,113 +105,233 @@ namespace sylar {
 
         assert(m_epfd > 0); // 错误就终止程序
 
-        // create pipe
-        int rt = pipe(m_tickleFds); // 创建管道的函数规定了m_tickleFds[0]是读端，1是写段
-        assert(!rt); // 错误就终止程序
+        // create eventfd
+        // 非阻塞，配合边缘触发；一个fd同时作为读端和写端
+        m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(m_tickleFd >= 0); // 错误就终止程序
 
-        // add read event to epoll // 将管道的监听注册到epoll上
+        // add read event to epoll // 将eventfd的监听注册到epoll上
         epoll_event event;
         event.events  = EPOLLIN | EPOLLET; // Edge Triggered，设置标志位，并且采用边缘触发和读事件。
-        event.data.fd = m_tickleFds[0];
-
-        // non-blocked
-        // 修改管道文件描述符以非阻塞的方式，配合边缘触发。
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-        // 是一个文件控制函数，用于改变文件描述符的行为。
-        // m_tickleFds[0]：是一个文件描述符，在这个例子中是管道的读端。
-        // O_NONBLOCK：将文件描述符设置为非阻塞。
-        // F_SETFL：是设置文件描述符的标识,如F_GETFD获取文件描述符的标志，F_SETFD设置文件描述符的标志。
+        event.data.fd = m_tickleFd;
+        int rt = epollCtl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
         assert(!rt);
 
-        //将 m_tickleFds[0];作为读事件放入到event监听集合中
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-        assert(!rt);
+        // create timerfd
+        // 定时器使用system_clock，所以timerfd也使用CLOCK_REALTIME，按绝对时间设置
+        m_timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        assert(m_timerFd >= 0);
+        // 每线程epoll模式下只注册在0号实例中，见下面
+        if(!(m_mode & MODE_EPOLL_PER_THREAD))
+        {
+            event.events  = EPOLLIN | EPOLLET;
+            event.data.fd = m_timerFd;
+            rt = epollCtl(m_epfd, EPOLL_CTL_ADD, m_timerFd, &event);
+            assert(!rt);
+        }
+
+        // create io_uring
+        // ring的fd有完成事件时变为可读，注册到epoll中，阻塞点仍然只有epoll_wait
+        if(m_mode & MODE_IO_URING)
+        {
+            m_uring.reset(new IoUring());
+            if(m_uring->init(URING_ENTRIES, URING_CQ_ENTRIES))
+            {
+                event.events  = EPOLLIN | EPOLLET;
+                event.data.fd = m_uring->getFd();
+                rt = epollCtl(m_epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+                assert(!rt);
+            }
+            else
+            {
+                std::cerr << "IOManager: io_uring is unavailable, fall back to epoll" << std::endl;
+                m_uring.reset();
+            }
+        }
+
+        // create per-thread epoll instances
+        // 每个实例有自己的eventfd。共享的m_epfd(非工作线程注册的fd、io_uring的完成事件)以水平触发只嵌套在0号实例中，
+        // timerfd也只注册在0号实例中：共享的事件和定时器到期只唤醒这一个线程，而不是让所有睡眠的线程一起醒来争抢
+        // 定时器也按线程各自等待：每个实例有自己的timerfd，插到分片堆顶的定时器只唤醒负责这个分片的线程
+        m_localTimers = (m_mode & MODE_EPOLL_PER_THREAD) && !(m_mode & MODE_BUSY_POLL);
+        setLocalWakeup(m_localTimers);
+        if(m_mode & MODE_EPOLL_PER_THREAD)
+        {
+            m_pollers.resize(threads);
+            for(size_t i = 0; i < m_pollers.size(); ++i)
+            {
+                auto& poller = m_pollers[i];
+                poller.reset(new Poller());
+                poller->epfd = epoll_create(5000);
+                assert(poller->epfd > 0);
+                poller->tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                assert(poller->tickleFd >= 0);
+
+                event.events  = EPOLLIN | EPOLLET;
+                event.data.fd = poller->tickleFd;
+                rt = epollCtl(poller->epfd, EPOLL_CTL_ADD, poller->tickleFd, &event);
+                assert(!rt);
+
+                if(m_localTimers)
+                {
+                    poller->timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+                    assert(poller->timerFd >= 0);
+                    event.events  = EPOLLIN | EPOLLET;
+                    event.data.fd = poller->timerFd;
+                    rt = epollCtl(poller->epfd, EPOLL_CTL_ADD, poller->timerFd, &event);
+                    assert(!rt);
+                }
 
-        contextResize(32); // 初始化了一个包含 32 个文件描述符上下文的数组
+                if(i != 0)
+                {
+                    continue;
+                }
+                event.events  = EPOLLIN;
+                event.data.fd = m_epfd;
+                rt = epollCtl(poller->epfd, EPOLL_CTL_ADD, m_epfd, &event);
+                assert(!rt);
+
+                event.events  = EPOLLIN | EPOLLET;
+                event.data.fd = m_timerFd;
+                rt = epollCtl(poller->epfd, EPOLL_CTL_ADD, m_timerFd, &event);
+                assert(!rt);
+            }
+        }
+
+        m_fdManager = FdMgr::GetInstance();
 
         start(); // 启动 Scheduler，开启线程池，准备处理任务。
     }
 
     // IOManager的析构函数
     IOManager::~IOManager() {
+        stopListening(); // 等待新连接的accept循环会让stop()一直等下去
         stop(); // 关闭scheduler类中的线程池，让任务全部执行完后线程安全退出
+        {
+            std::lock_guard<std::mutex> lock(m_blockingMutex);
+            m_blockingStop = true;
+        }
+        m_blockingCond.notify_all();
+        for (auto& thread : m_blockingThreads)
+        {
+            thread->join();
+        }
         close(m_epfd); // 关闭epoll的句柄（文件描述符）
-        close(m_tickleFds[0]); // 关闭管道读端写端
-        close(m_tickleFds[1]);
-
-        // 将fdcontext文件描述符一个个关闭
-        for (size_t i = 0; i < m_fdContexts.size(); ++i)
+        close(m_tickleFd);
+        close(m_timerFd);
+        m_bufRing.reset();
+        m_uring.reset();
+        for (auto& poller : m_pollers)
         {
-            if (m_fdContexts[i])
+            close(poller->epfd);
+            close(poller->tickleFd);
+            if (poller->timerFd >= 0)
             {
-                delete m_fdContexts[i];
+                close(poller->timerFd);
             }
         }
-    }
 
-    // no lock
-    // 主要作用是调整m_fdContexts数组的大小，并为新的文件描述符(fd)创建并初始化相应的Fdcontext对象。
-    void IOManager::contextResize(size_t size)
-    {
-        m_fdContexts.resize(size); // 调整m_fdContexts的大小
-
-        // 遍历 m_fdContexts 向量，初始化尚未初始化的 FdContext 对象
-        for (size_t i = 0; i < m_fdContexts.size(); ++i)
+        // 记录比IOManager活得久：清掉本IOManager留下的注册状态，之后别的IOManager可以重新注册这些fd
+        m_fdManager->forEach([this](FdContext& fd_ctx)
         {
-            if (m_fdContexts[i]==nullptr)
+            std::lock_guard<std::mutex> lock(fd_ctx.mutex);
+            if (fd_ctx.manager == this)
             {
-                m_fdContexts[i] = new FdContext();
-                m_fdContexts[i]->fd = i; // 将文件描述符的编号赋值给 fd
+                fd_ctx.registered = false;
+                fd_ctx.ready = NONE;
+                fd_ctx.owner = -1;
+                fd_ctx.ownerThread = -1;
+                fd_ctx.busyPoll = false;
+                fd_ctx.manager = nullptr;
             }
-        }
+            // 定时器所在的分片随本IOManager一起析构，不能再被复用
+            fd_ctx.dropTimeoutTimers(getId());
+            // ring已经关闭，不会再有完成事件来释放multishot请求的自引用
+            if (fd_ctx.multishot && fd_ctx.multishot->manager == this)
+            {
+                fd_ctx.multishot->self.reset();
+                fd_ctx.multishot.reset();
+            }
+        });
     }
 
-    // 主要作用是为一个上面contextResize()分配好的fd，添加一个event事件，并在事件触发时执行指定的回调函数(cb)或回调协程具体的触发是在triggerEvent。
+    // 主要作用是为一个fd添加一个event事件，并在事件触发时执行指定的回调函数(cb)或回调协程具体的触发是在triggerEvent。
     int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
     {
+        m_addEventCalls.fetch_add(1, std::memory_order_relaxed);
+
         // 查找FdContext对象
         // attemp to find FdContext
-        FdContext *fd_ctx = nullptr;
-
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex); // 使用读写锁
-        if ((int)m_fdContexts.size() > fd) // 如果说传入的fd在数组里面则查找然后初始化FdContext的对象
-        {
-            fd_ctx = m_fdContexts[fd];
-            read_lock.unlock();
-        }
-        else // 不存在则重新分配数组的size来初始化FdContext的对象
+        // 所在的段还没有分配时分配它，不需要加锁
+        FdContext *fd_ctx = m_fdManager->lookup(fd, true);
+        if (!fd_ctx)
         {
-            read_lock.unlock();
-            std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-            contextResize(fd * 1.5);
-            fd_ctx = m_fdContexts[fd];
+            return -1;
         }
 
         // 一旦找到或者创建Fdcontext的对象后，加上互斥锁，确保Fdcontext的状态不会被其他线程修改
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
 
-        // the event has already been added
-        if(fd_ctx->events & event) // 判断事件是否存在存在？是就返回-1，因为相同的事件不能重复添加
+        if ((m_mode & MODE_BUSY_POLL) && !fd_ctx->busyPoll)
         {
-            return -1;
+            enableBusyPoll(fd);
+            fd_ctx->busyPoll = true;
         }
 
-        // add new event
-        // 所以这里就很好判断了如果已经存在就fd_ctx->events本身已经有读或写，就是修改已经有事件，如果不存在就是none事件的情况，就添加事件。
-        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-        epoll_event epevent;
-        epevent.events   = EPOLLET | fd_ctx->events | event;
-        epevent.data.ptr = fd_ctx;
+        if (m_mode & MODE_EPOLL_PERSISTENT)
+        {
+            // 之前到达过、还没有被消耗的就绪事件：消耗掉它，调用方直接重试，不必挂起
+            if (fd_ctx->ready & event)
+            {
+                fd_ctx->ready &= ~event;
+                return 1;
+            }
 
-        // 函数将事件添加到 epoll 中。如果添加失败，打印错误信息并返回 -1。
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+            // 第一次使用时注册读写两个方向，之后不再修改
+            if (!fd_ctx->registered)
+            {
+                if (fd_ctx->owner < 0)
+                {
+                    fd_ctx->owner = bindPoller();
+                    fd_ctx->ownerThread = fd_ctx->owner < 0 ? -1 : Thread::GetThreadId();
+                }
+                epoll_event epevent;
+                epevent.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+                epevent.data.ptr = fd_ctx;
+                if (epollCtl(epfdOf(fd_ctx), EPOLL_CTL_ADD, fd, &epevent))
+                {
+                    std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                    return -1;
+                }
+                fd_ctx->registered = true;
+            }
+        }
+        else if (!(fd_ctx->events & event)) // 这个方向上已经有等待者时epoll中已经注册了，只需要排到等待队列后面
         {
-            std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return -1;
+            // add new event
+            // 所以这里就很好判断了如果已经存在就fd_ctx->events本身已经有读或写，就是修改已经有事件，如果不存在就是none事件的情况，就添加事件。
+            int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            // 每线程epoll模式：还没有归属的fd归第一个在它上面等待的工作线程
+            if (op == EPOLL_CTL_ADD && fd_ctx->owner < 0)
+            {
+                fd_ctx->owner = bindPoller();
+                fd_ctx->ownerThread = fd_ctx->owner < 0 ? -1 : Thread::GetThreadId();
+            }
+            epoll_event epevent;
+            epevent.events   = EPOLLET | fd_ctx->events | event;
+            epevent.data.ptr = fd_ctx;
+
+            // 函数将事件添加到 epoll 中。如果添加失败，打印错误信息并返回 -1。
+            int rt = epollCtl(epfdOf(fd_ctx), op, fd, &epevent);
+            if (rt)
+            {
+                std::cerr << "addEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
         }
 
         ++m_pendingEventCount; // 原子计数器，待处理的事件++；
+        fd_ctx->manager = this;
 
         // update fdcontext
         // 更新 FdContext 的 events 成员，记录当前的所有事件。注意events可以监听读和写的组合，如果fd_ctx->events为none,就相当于直接是fd_ctx->events = event
@@ -188,38 +339,34 @@ namespace sylar {
         // "|"运算符相当于把他俩加起来了，因为二进制中有一个为1，结果就为1
 
         // update event context
-        // 设置事件上下文
+        // 在该方向的等待队列末尾加入一个等待者
         FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
-        assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb); // 确保 EventContext 中没有其他正在执行的调度器、协程或回调函数。
-        event_ctx.scheduler = Scheduler::GetThis(); //设置调度器为当前的调度器实例Scheduler::GetThis()。
+        event_ctx.waiters.emplace_back();
+        FdContext::Waiter& waiter = event_ctx.waiters.back();
+        waiter.scheduler = Scheduler::GetThis(); //设置调度器为当前的调度器实例Scheduler::GetThis()。
 
-        // 如果提供了回调函数 cb，则将其保存到 EventContext 中；否则，将当前正在运行的协程保存到 EventContext 中，并确保协程的状态是正在运行。
+        // 如果提供了回调函数 cb，则将其保存到 Waiter 中；否则，将当前正在运行的协程保存到 Waiter 中，并确保协程的状态是正在运行。
         if (cb)
         {
-            event_ctx.cb.swap(cb);
+            waiter.cb.swap(cb);
         }
         else
         {
-            event_ctx.fiber = Fiber::GetThis(); // 需要确保存在主协程
-            assert(event_ctx.fiber->getState() == Fiber::RUNNING);
+            waiter.fiber = Fiber::GetThis(); // 需要确保存在主协程
+            assert(waiter.fiber->getState() == Fiber::RUNNING);
         }
         return 0;
     }
 
     // 目的是从IOManager中删除某个文件描述符(fd)的特定事件(event)。
     bool IOManager::delEvent(int fd, Event event) {
-        // attemp to find FdContext
-        FdContext *fd_ctx = nullptr;
+        m_delEventCalls.fetch_add(1, std::memory_order_relaxed);
 
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex); // 读锁
-        if ((int)m_fdContexts.size() > fd) // 查找FdContext。如果没查找到代表数组中没这个文件描述符，直接返回false；
-        {
-            fd_ctx = m_fdContexts[fd];
-            read_lock.unlock();
-        }
-        else
+        // attemp to find FdContext
+        // 查找FdContext。所在的段还没有分配代表没有这个文件描述符的事件，直接返回false；
+        FdContext *fd_ctx = m_fdManager->lookup(fd, false);
+        if (!fd_ctx)
         {
-            read_lock.unlock();
             return false;
         }
 
@@ -235,47 +382,44 @@ namespace sylar {
         // delete the event
         // 因为这里要删除事件，对原有的事件状态取反就是删除原有的状态。比如说传入参数是读事件，我们取反就是删除了这个读事件但可能还要写事件
         Event new_events = (Event)(fd_ctx->events & ~event);
-        int op           = (new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
-        epoll_event epevent;
-        epevent.events   = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx; // 这一步是为了在 epoll 事件触发时能够快速找到与该事件相关联的 FdContext 对象。
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        // 持久注册模式下epoll中的注册保持不变
+        if (!fd_ctx->registered)
         {
-            std::cerr << "delEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return -1;
+            int op           = (new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+            epoll_event epevent;
+            epevent.events   = EPOLLET | new_events;
+            epevent.data.ptr = fd_ctx; // 这一步是为了在 epoll 事件触发时能够快速找到与该事件相关联的 FdContext 对象。
+
+            int rt = epollCtl(epfdOf(fd_ctx), op, fd, &epevent);
+            if (rt)
+            {
+                std::cerr << "delEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
         }
 
-        --m_pendingEventCount; // 减少了待处理的事件
+        // update event context
+        // 重置上下文，该方向上的等待者全部丢弃
+        FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+        m_pendingEventCount -= event_ctx.waiters.size(); // 减少了待处理的事件
+        fd_ctx->resetEventContext(event_ctx);
 
         // update fdcontext
         // 因为要先将fd_ctx的状态放入epevent.data.ptr所以就没先去更新，这也是为什么需要单独写Event new_events
         fd_ctx->events = new_events;
-
-        // update event context
-        // 重置上下文
-        FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
-        fd_ctx->resetEventContext(event_ctx);
         return true;
     }
 
     // 取消特定文件描述符上的指定事件(如读事件或写事件)，并触发该事件的回调函数。
     // 这里相比delEvent不同在于删除事件后，还需要将删除的事件直接交给trigger函数放入到协程调度器中进行触发。
     bool IOManager::cancelEvent(int fd, Event event) {
-        // attemp to find FdContext
-        FdContext *fd_ctx = nullptr;
+        m_cancelEventCalls.fetch_add(1, std::memory_order_relaxed);
 
-        // 这里步骤和delEvent一致
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-        if ((int)m_fdContexts.size() > fd)
-        {
-            fd_ctx = m_fdContexts[fd];
-            read_lock.unlock();
-        }
-        else
+        // attemp to find FdContext
+        // 查找FdContext。所在的段还没有分配代表没有这个文件描述符的事件，直接返回false；
+        FdContext *fd_ctx = m_fdManager->lookup(fd, false);
+        if (!fd_ctx)
         {
-            read_lock.unlock();
             return false;
         }
 
@@ -289,44 +433,68 @@ namespace sylar {
 
         // delete the event
         Event new_events = (Event)(fd_ctx->events & ~event);
-        int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events   = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        if (!fd_ctx->registered)
         {
-            std::cerr << "cancelEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return -1;
-        }
+            int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+            epoll_event epevent;
+            epevent.events   = EPOLLET | new_events;
+            epevent.data.ptr = fd_ctx;
 
-        --m_pendingEventCount;
+            int rt = epollCtl(epfdOf(fd_ctx), op, fd, &epevent);
+            if (rt)
+            {
+                std::cerr << "cancelEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
 
         // update fdcontext, event context and trigger
-        fd_ctx->triggerEvent(event); // 这个代码和上面那个delEvent一致。就是最后的处理不同一个是重置，一个是调用事件的回调函数
+        // 这个代码和上面那个delEvent一致。就是最后的处理不同一个是重置，一个是调用事件的回调函数；不论唤醒方式，全部等待者都被唤醒
+        m_pendingEventCount -= fd_ctx->triggerEvent(event, 0, true);
         return true;
     }
 
     // 取消指定文件描述符(fd)上的所有事件，并且触发这些事件的回调。
-    bool IOManager::cancelAll(int fd) {
-        // attemp to find FdContext
-        FdContext *fd_ctx = nullptr;
+    // file_fd见uringCancel
+    bool IOManager::cancelAll(int fd, int file_fd) {
+        m_cancelAllCalls.fetch_add(1, std::memory_order_relaxed);
 
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-        if ((int)m_fdContexts.size() > fd)
-        {
-            fd_ctx = m_fdContexts[fd];
-            read_lock.unlock();
-        }
-        else
+        // 提交给io_uring的操作也一并取消
+        uringCancel(fd, file_fd);
+
+        // attemp to find FdContext
+        // 查找FdContext。所在的段还没有分配代表没有这个文件描述符的事件，直接返回false；
+        FdContext *fd_ctx = m_fdManager->lookup(fd, false);
+        if (!fd_ctx)
         {
-            read_lock.unlock();
             return false;
         }
+        uringDetach(fd_ctx);
 
         std::lock_guard<std::mutex> lock(fd_ctx->mutex);
 
+        // close时放弃归属，fd号被复用时重新由第一个等待的线程认领
+        int epfd = epfdOf(fd_ctx);
+        fd_ctx->owner = -1;
+        fd_ctx->ownerThread = -1;
+        fd_ctx->busyPoll = false;
+        fd_ctx->read.wakeOne = false;
+        fd_ctx->write.wakeOne = false;
+
+        // 持久注册的fd在这里(close时)注销，清空就绪状态，fd号被复用时重新注册
+        bool registered = fd_ctx->registered;
+        if (registered)
+        {
+            epoll_event epevent = {};
+            // fd号被dup2覆盖之后按号找不到原来的注册(ENOENT)，它随原来的文件关闭一起失效
+            if (epollCtl(epfd, EPOLL_CTL_DEL, fd, &epevent) && errno != ENOENT)
+            {
+                std::cerr << "cancelAll::epoll_ctl failed: " << strerror(errno) << std::endl;
+            }
+            fd_ctx->registered = false;
+            fd_ctx->ready = NONE;
+        }
+
         // none of events exist
         if (!fd_ctx->events)
         {
@@ -334,191 +502,1383 @@ namespace sylar {
         }
 
         // delete all events
-        int op = EPOLL_CTL_DEL;
-        epoll_event epevent;
-        epevent.events   = 0;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        if (!registered)
         {
-            std::cerr << "IOManager::epoll_ctl failed: " << strerror(errno) << std::endl;
-            return -1;
+            int op = EPOLL_CTL_DEL;
+            epoll_event epevent;
+            epevent.events   = 0;
+            epevent.data.ptr = fd_ctx;
+
+            int rt = epollCtl(epfd, op, fd, &epevent);
+            if (rt && errno != ENOENT) // 同上，等待者仍然要唤醒
+            {
+                std::cerr << "IOManager::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
         }
 
         // update fdcontext, event context and trigger
         if (fd_ctx->events & READ)
         {
-            fd_ctx->triggerEvent(READ);
-            --m_pendingEventCount;
+            m_pendingEventCount -= fd_ctx->triggerEvent(READ, 0, true);
         }
 
         if (fd_ctx->events & WRITE)
         {
-            fd_ctx->triggerEvent(WRITE);
-            --m_pendingEventCount;
+            m_pendingEventCount -= fd_ctx->triggerEvent(WRITE, 0, true);
         }
 
         assert(fd_ctx->events == 0);
         return true;
     }
 
-    // 检测到有空闲线程时，通过写入一个字符到管(m_tickleFds[1]) 中，唤醒那些等待任务的线程。
-    void IOManager::tickle()
+    bool IOManager::setWakeMode(int fd, Event event, WakeMode mode)
     {
-        // no idle threads
-        if(!hasIdleThreads()) // 这个函数在scheduler检查当前是否有线程处于空闲状态。如果没有空闲线程，函数直接返回，不执行后续操作。
+        FdContext *fd_ctx = m_fdManager->lookup(fd, true);
+        if (!fd_ctx)
         {
-            return;
+            return false;
         }
-        //如果有空闲线程，函数会向管道 m_tickleFds[1] 写入一个字符 "T"。这个写操作的目的是向等待在 m_tickleFds[0]（管道的另一端）的线程发送一个信号，通知它有新任务可以处理了。
-        int rt = write(m_tickleFds[1], "T", 1);
-        assert(rt == 1);
-    }
 
-    // 检查定时器、挂起事件以及调度器状态，以决定是否可以安全地停止运行。
-    bool IOManager::stopping()
-    {
-        uint64_t timeout = getNextTimer();
-        // no timers left and no pending events left with the Scheduler::stopping()
-        return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        fd_ctx->getEventContext(event).wakeOne = (mode == WAKE_ONE);
+        return true;
     }
 
-    // 在没有任务处理时运行(或者即使当前没有任务处理，线程也会在 idle() 中持续休眠并等待新的任务。保证了在所有任务完成之前调度器不会退出)，等待和处理 I/O 事件。
-    void IOManager::idle()
+    // 只取消fiber自己的等待并唤醒它，同一方向上的其他等待者继续等待
+    bool IOManager::cancelWait(int fd, Event event, const Fiber* fiber)
     {
-        static const uint64_t MAX_EVNETS = 256; // epoll_wait能同时处理的最大事件数为256个
+        m_cancelEventCalls.fetch_add(1, std::memory_order_relaxed);
 
-        // 使用 std::unique_ptr 动态分配了一个大小为 MAX_EVENTS 的 epoll_event 数组，用于存储从 epoll_wait 获取的事件。
-        std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVNETS]);
-
-        while (true)
+        FdContext *fd_ctx = m_fdManager->lookup(fd, false);
+        if (!fd_ctx)
         {
-            if(debug) std::cout << "IOManager::idle(),run in thread: " << Thread::GetThreadId() << std::endl;
+            return false;
+        }
 
-            if(stopping())
-            {
-                if(debug) std::cout << "name = " << getName() << " idle exits in thread: " << Thread::GetThreadId() << std::endl;
-                break;
-            }
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
 
-            // blocked at epoll_wait
-            int rt = 0;
-            while(true)
-            {
-                static const uint64_t MAX_TIMEOUT = 5000; //定义了最大超时时间为 5000 毫秒。
-                uint64_t next_timeout = getNextTimer(); // 获取下一个超时的定时器
-                // 注意：这里的epoll_wait的超时时间，用getNexTimer()从超时时间堆中取出了一开始超时的定时器的时间和epoll_wait原生超时时间5000ms进行一个min的比较。
-                next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+        // the event doesn't exist
+        if (!(fd_ctx->events & event))
+        {
+            return false;
+        }
 
-                // epoll_wait陷入阻塞，等待tickle信号的唤醒，
-                // 并且使用了定时器堆中最早超时的定时器作为epoll_wait超时时间。
-                rt = epoll_wait(m_epfd, events.get(), MAX_EVNETS, (int)next_timeout);
-                // EINTR -> retry
-                if(rt < 0 && errno == EINTR) // rt小于0代表无限阻塞，errno是EINTR(表示信号中断)
-                {
-                    continue;
-                }
-                else
-                {
-                    break;
-                }
-            };
+        FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+        auto it = std::find_if(event_ctx.waiters.begin(), event_ctx.waiters.end(),
+                               [fiber](const FdContext::Waiter& w) { return w.fiber.get() == fiber; });
+        if (it == event_ctx.waiters.end())
+        {
+            return false;
+        }
 
-            // collect all timers overdue
-            std::vector<std::function<void()>> cbs; // 用于存储超时的回调函数。
-            listExpiredCb(cbs); // 用来获取所有超时的定时器回调，并将它们添加到 cbs 向量中。
-            if(!cbs.empty())
+        // 最后一个等待者离开时才从epoll中去掉这个方向
+        if (event_ctx.waiters.size() == 1)
+        {
+            Event new_events = (Event)(fd_ctx->events & ~event);
+            if (!fd_ctx->registered)
             {
-                for(const auto& cb : cbs)
+                int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                epoll_event epevent;
+                epevent.events   = EPOLLET | new_events;
+                epevent.data.ptr = fd_ctx;
+
+                if (epollCtl(epfdOf(fd_ctx), op, fd, &epevent))
                 {
-                    scheduleLock(cb);
+                    std::cerr << "cancelWait::epoll_ctl failed: " << strerror(errno) << std::endl;
+                    return false;
                 }
-                cbs.clear();
             }
+            fd_ctx->events = new_events;
+        }
 
-            // collect all events ready
-            // 遍历所有的rt，代表有多少个事件准备了。
-            for (int i = 0; i < rt; ++i)
-            {
-                epoll_event& event = events[i]; // 获取第 i 个 epoll_event，用于处理该事件。
+        fd_ctx->wakeWaiter(*it);
+        event_ctx.waiters.erase(it);
+        --m_pendingEventCount;
+        return true;
+    }
 
-                // tickle event
-                // 检查当前事件是否是 tickle 事件（即用于唤醒空闲线程的事件）。
-                if (event.data.fd == m_tickleFds[0]) // 检查事件是否来自管道的读端
-                {
-                    uint8_t dummy[256];
-                    // edge triggered -> exhaust
-                    while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0); // 因为是edge trigger(ET)模式循环读取管道数据直到清空
-                    continue; // 跳过后续事件处理
-                }
+    // 只唤醒一个等待者时，被唤醒的等待者消耗了就绪状态后把接力棒交给下一个：
+    // 用EPOLL_CTL_MOD重新注册，fd仍然就绪时边缘触发会再报告一次，由下一个等待者处理
+    bool IOManager::rearmEvent(int fd, Event event)
+    {
+        FdContext *fd_ctx = m_fdManager->lookup(fd, false);
+        if (!fd_ctx)
+        {
+            return false;
+        }
 
-                // other events
-                // 通过 event.data.ptr 获取与当前事件关联的 FdContext 指针 fd_ctx，该指针包含了与文件描述符相关的上下文信息。
-                FdContext *fd_ctx = (FdContext *)event.data.ptr;
-                std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+        if (!event_ctx.wakeOne || event_ctx.waiters.empty())
+        {
+            return false;
+        }
 
-                // convert EPOLLERR or EPOLLHUP to -> read or write event
-                // 如果当前事件是错误或挂起（EPOLLERR 或 EPOLLHUP），则将其转换为可读或可写事件（EPOLLIN 或 EPOLLOUT），以便后续处理。
-                if (event.events & (EPOLLERR | EPOLLHUP))
-                {
-                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
-                }
-                // events happening during this turn of epoll_wait
-                // 确定实际发生的事件类型（读取、写入或两者）。
-                int real_events = NONE;
-                if (event.events & EPOLLIN)
-                {
-                    real_events |= READ;
-                }
-                if (event.events & EPOLLOUT)
-                {
-                    real_events |= WRITE;
-                }
+        epoll_event epevent;
+        epevent.events   = fd_ctx->registered ? (EPOLLIN | EPOLLOUT | EPOLLET) : (EPOLLET | fd_ctx->events);
+        epevent.data.ptr = fd_ctx;
+        if (epollCtl(epfdOf(fd_ctx), EPOLL_CTL_MOD, fd, &epevent))
+        {
+            std::cerr << "rearmEvent::epoll_ctl failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
 
-                if ((fd_ctx->events & real_events) == NONE)
-                {
-                    continue;
-                }
+    // 检测到有线程阻塞在epoll_wait时，向eventfd写入1，唤醒那些等待任务的线程。
+    void IOManager::tickle()
+    {
+        // no idle threads
+        if(!hasIdleThreads()) // 这个函数在scheduler检查当前是否有线程处于空闲状态。如果没有空闲线程，函数直接返回，不执行后续操作。
+        {
+            return;
+        }
 
-                // delete the events that have already happened
-                // 这里进行取反就是计算剩余未发送的的事件
-                int left_events = (fd_ctx->events & ~real_events);
-                int op          = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-                //如果left_event没有事件了那么就只剩下边缘触发了events设置了
-                event.events    = EPOLLET | left_events;
+        // 忙轮询模式下没有线程阻塞，推进计数让空转的线程让出即可，不需要系统调用
+        if(m_mode & MODE_BUSY_POLL)
+        {
+            m_busyTickles.fetch_add(1, std::memory_order_release);
+            m_tickleSkipped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
 
-                // 根据之前计算的操作（op），调用 epoll_ctl 更新或删除 epoll 监听，如果失败，打印错误并继续处理下一个事件。
-                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-                if (rt2)
-                {
-                    std::cerr << "idle::epoll_ctl failed: " << strerror(errno) << std::endl;
-                    continue;
-                }
+        // 空闲线程还没有进入epoll_wait时不需要写：它在睡眠前先增加m_sleepingThreads，再检查任务队列和定时器。
+        // 调用方已经把任务放进队列，这里的屏障和idle中的屏障保证双方至少有一方看到对方的修改
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-                // schedule callback and update fdcontext and event context
-                // 触发事件，事件的执行
-                if (real_events & READ)
-                {
-                    fd_ctx->triggerEvent(READ);
-                    --m_pendingEventCount;
-                }
-                if (real_events & WRITE)
-                {
-                    fd_ctx->triggerEvent(WRITE);
-                    --m_pendingEventCount;
-                }
-            } // end for
+        // 每线程epoll模式：认领一个正在睡眠的线程，只唤醒它
+        for(auto& poller : m_pollers)
+        {
+            if(poller->sleeping.load(std::memory_order_relaxed) && poller->sleeping.exchange(false))
+            {
+                uint64_t one = 1;
+                int rt = write(poller->tickleFd, &one, sizeof(one));
+                assert(rt == sizeof(one));
+                m_tickleWritten.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        if(m_sleepingThreads.load(std::memory_order_relaxed) == 0)
+        {
+            m_tickleSkipped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        uint64_t one = 1;
+        int rt = write(m_tickleFd, &one, sizeof(one));
+        assert(rt == sizeof(one));
+        m_tickleWritten.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void IOManager::tickleThread(int thread)
+    {
+        if(m_pollers.empty() || (m_mode & MODE_BUSY_POLL))
+        {
+            tickle();
+            return;
+        }
+
+        // 任务交给了当前线程自己(例如轮询线程恢复自己fd上的协程)：idle让出后run就会取到它
+        if(thread == Thread::GetThreadId())
+        {
+            m_tickleSkipped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(auto& poller : m_pollers)
+        {
+            if(poller->threadId.load(std::memory_order_relaxed) != thread)
+            {
+                continue;
+            }
+            if(poller->sleeping.load(std::memory_order_relaxed) && poller->sleeping.exchange(false))
+            {
+                uint64_t one = 1;
+                int rt = write(poller->tickleFd, &one, sizeof(one));
+                assert(rt == sizeof(one));
+                m_tickleWritten.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                m_tickleSkipped.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+
+        // 目标线程没有绑定epoll实例
+        tickle();
+    }
+
+    double IOManager::getPollRate() const
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_createTime).count();
+        return seconds > 0 ? getPollIterations() / seconds : 0;
+    }
+
+    double IOManager::getEmptyPollRatio() const
+    {
+        uint64_t iterations = getPollIterations();
+        return iterations ? (double)getEmptyPolls() / iterations : 0;
+    }
+
+    IOStats IOManager::getIOStats() const
+    {
+        IOStats stats;
+        stats.time = std::chrono::steady_clock::now();
+        stats.addEvents = m_addEventCalls.load(std::memory_order_relaxed);
+        stats.delEvents = m_delEventCalls.load(std::memory_order_relaxed);
+        stats.cancelEvents = m_cancelEventCalls.load(std::memory_order_relaxed);
+        stats.cancelAlls = m_cancelAllCalls.load(std::memory_order_relaxed);
+        stats.epollCtls = m_epollCtlCalls.load(std::memory_order_relaxed);
+        stats.waitTime = m_waitTime.snapshot();
+        stats.eventsPerWait = m_eventsPerWait.snapshot();
+        stats.loopTime = m_loopTime.snapshot();
+        stats.wakeupLatency = m_wakeupLatency.snapshot();
+        return stats;
+    }
+
+    void IOManager::resetIOStats()
+    {
+        m_waitTime.reset();
+        m_eventsPerWait.reset();
+        m_loopTime.reset();
+        m_wakeupLatency.reset();
+    }
+
+    void IOManager::onFiberReady(uint64_t ready_time)
+    {
+        uint64_t now = NowNs();
+        m_wakeupLatency.record(now > ready_time ? now - ready_time : 0);
+    }
+
+    int IOManager::epollCtl(int epfd, int op, int fd, epoll_event* event)
+    {
+        m_epollCtlCalls.fetch_add(1, std::memory_order_relaxed);
+        return epoll_ctl(epfd, op, fd, event);
+    }
+
+    int IOManager::bindPoller()
+    {
+        if(m_pollers.empty())
+        {
+            return -1;
+        }
+        if(t_poller_manager == this)
+        {
+            return t_poller;
+        }
+        // 只有本调度器的工作线程才分配实例
+        if(Scheduler::GetThis() != this)
+        {
+            return -1;
+        }
+        // 实例用完(线程数超过构造时的数量)时退回共享的m_epfd
+        size_t index = m_nextPoller.fetch_add(1);
+        t_poller_manager = this;
+        t_poller = index < m_pollers.size() ? (int)index : -1;
+        if(t_poller >= 0)
+        {
+            m_pollers[t_poller]->threadId.store(Thread::GetThreadId());
+        }
+        return t_poller;
+    }
+
+    void IOManager::unbindPoller()
+    {
+        if(t_poller_manager == this)
+        {
+            if(t_poller >= 0)
+            {
+                m_pollers[t_poller]->threadId.store(-1);
+            }
+            t_poller_manager = nullptr;
+            t_poller = -1;
+        }
+    }
+
+    int IOManager::epfdOf(const FdContext *fd_ctx) const
+    {
+        return fd_ctx->owner < 0 ? m_epfd : m_pollers[fd_ctx->owner]->epfd;
+    }
+
+    bool IOManager::migrateFd(int fd, int thread)
+    {
+        int target = -1;
+        for(size_t i = 0; i < m_pollers.size(); ++i)
+        {
+            if(m_pollers[i]->threadId.load() == thread)
+            {
+                target = i;
+                break;
+            }
+        }
+        if(target < 0)
+        {
+            return false;
+        }
+
+        // 所在的段还没有分配时分配它，不需要加锁
+        FdContext *fd_ctx = m_fdManager->lookup(fd, true);
+        if (!fd_ctx)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+        if (fd_ctx->owner == target)
+        {
+            return true;
+        }
+
+        // 已经注册的fd先加入目标实例再从原实例删除：加入时边缘触发会报告当前的就绪状态，不会丢事件；
+        // 两边都报告的同一个事件在处理时发现已经没有等待者，会被忽略
+        uint32_t mask = 0;
+        if (fd_ctx->registered)
+        {
+            mask = EPOLLIN | EPOLLOUT | EPOLLET;
+        }
+        else if (fd_ctx->events)
+        {
+            mask = EPOLLET | fd_ctx->events;
+        }
+        if (mask)
+        {
+            epoll_event epevent;
+            epevent.events   = mask;
+            epevent.data.ptr = fd_ctx;
+            if (epollCtl(m_pollers[target]->epfd, EPOLL_CTL_ADD, fd, &epevent))
+            {
+                std::cerr << "migrateFd::epoll_ctl failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+            epoll_event old = {};
+            if (epollCtl(epfdOf(fd_ctx), EPOLL_CTL_DEL, fd, &old))
+            {
+                std::cerr << "migrateFd::epoll_ctl failed: " << strerror(errno) << std::endl;
+            }
+        }
+
+        fd_ctx->owner = target;
+        fd_ctx->ownerThread = thread;
+        fd_ctx->manager = this;
+        return true;
+    }
+
+    // 检查定时器、挂起事件以及调度器状态，以决定是否可以安全地停止运行。
+    bool IOManager::stopping()
+    {
+        // no timers left and no pending events left with the Scheduler::stopping()
+        // getNextTimer()返回的是最早时间的下界，定时器全部取消后可能还没有重新计算，这里直接看各分片的堆
+        return !hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping();
+    }
+
+    // 在没有任务处理时运行(或者即使当前没有任务处理，线程也会在 idle() 中持续休眠并等待新的任务。保证了在所有任务完成之前调度器不会退出)，等待和处理 I/O 事件。
+    void IOManager::idle()
+    {
+        static const uint64_t MAX_EVNETS = 256; // epoll_wait能同时处理的最大事件数为256个
+
+        // 使用 std::unique_ptr 动态分配了一个大小为 MAX_EVENTS 的 epoll_event 数组，用于存储从 epoll_wait 获取的事件。
+        std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVNETS]);
+
+        // 当前工作线程创建的定时器放入自己的分片，不再和其他线程竞争同一把锁
+        size_t timer_shard = bindTimerShard();
+        // 每线程epoll模式：绑定独占的epoll实例，只等待自己的fd；绑定0号实例的线程还负责共享的m_epfd和timerfd
+        int poller_index = bindPoller();
+        Poller* poller = poller_index < 0 ? nullptr : m_pollers[poller_index].get();
+        int wait_fd = poller ? poller->epfd : m_epfd;
+        // 定时器分片各自唤醒：只按自己分片的最早定时器睡眠、只收集自己分片的定时器，绑定0号实例的线程再加上共享的0号分片
+        bool local_timers = m_localTimers && poller;
+        bool shared_timers = poller_index == 0;
+        if(poller)
+        {
+            poller->timerShard.store((int)timer_shard);
+        }
+
+        // 忙轮询模式：epoll_wait不阻塞。上一轮什么都没有发生(spinning)时跳过停止检查、定时器计算和让出，直接再轮询；
+        // 有新任务时tickle会推进m_busyTickles，看到变化就让出给run
+        bool busy = m_mode & MODE_BUSY_POLL;
+        bool spinning = false;
+        uint64_t seen_tickles = m_busyTickles.load(std::memory_order_acquire);
+        // 本线程攒下的轮询统计，定期合并到共享计数，避免每一轮都写同一条缓存行
+        uint64_t iterations = 0;
+        uint64_t empty_polls = 0;
+
+        while (true)
+        {
+            if(!spinning)
+            {
+                // 忙轮询模式下完整的一轮每秒可能有成千上万次，不在这里做I/O
+                if(debug && !busy) std::cout << "IOManager::idle(),run in thread: " << Thread::GetThreadId() << std::endl;
+
+                if(stopping())
+                {
+                    if(debug) std::cout << "name = " << getName() << " idle exits in thread: " << Thread::GetThreadId() << std::endl;
+                    m_pollIterations.fetch_add(iterations, std::memory_order_relaxed);
+                    m_emptyPolls.fetch_add(empty_polls, std::memory_order_relaxed);
+                    unbindTimerShard();
+                    unbindPoller();
+                    break;
+                }
+            }
+
+            // 把各个协程这一轮攒下的io_uring操作一次性提交
+            if(m_uring)
+            {
+                std::lock_guard<std::mutex> lock(m_uring->sqMutex);
+                m_uring->submit();
+            }
+
+            int rt = 0;
+            bool recheck = false;
+            uint64_t wait_start = 0;
+            if(busy)
+            {
+                // 定时器由timerfd报告，只在完整的一轮里按最近的定时器设置；新的最早定时器插入时tickle会结束空转
+                if(!spinning)
+                {
+                    uint64_t next_ns = getNextTimerNs();
+                    if(next_ns != 0 && next_ns != ~0ull)
+                    {
+                        armTimerFd(next_ns);
+                    }
+                }
+
+                wait_start = NowNs();
+                rt = epoll_wait(wait_fd, events.get(), MAX_EVNETS, 0);
+                if(rt < 0)
+                {
+                    rt = 0;
+                }
+                ++iterations;
+                if(rt == 0)
+                {
+                    ++empty_polls;
+                }
+                if(iterations % BUSY_POLL_CHECK == 0)
+                {
+                    m_pollIterations.fetch_add(iterations, std::memory_order_relaxed);
+                    m_emptyPolls.fetch_add(empty_polls, std::memory_order_relaxed);
+                    iterations = 0;
+                    empty_polls = 0;
+                    // 定期让出做一次完整的检查，防止错过没有推进m_busyTickles的任务
+                    recheck = true;
+                }
+            }
+            else
+            {
+                // 先声明自己要睡眠，再检查一次任务队列和停止标志：在此之前的tickle可能因为看不到睡眠线程而被省略
+                if(poller)
+                {
+                    poller->sleeping.store(true, std::memory_order_relaxed);
+                }
+                else
+                {
+                    m_sleepingThreads.fetch_add(1, std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // 只看当前线程能执行的任务：固定给其他线程的任务由run()唤醒目标线程，这里算上它们会让本线程空转
+                if(hasRunnableTasks() || stopping())
+                {
+                    if(poller)
+                    {
+                        poller->sleeping.store(false, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        m_sleepingThreads.fetch_sub(1, std::memory_order_relaxed);
+                    }
+                    Fiber::GetThis()->yield();
+                    continue;
+                }
+
+                // blocked at epoll_wait
+                wait_start = NowNs();
+                while(true)
+                {
+                    static const uint64_t MAX_TIMEOUT = 5000; //定义了最大超时时间为 5000 毫秒。
+                    uint64_t next_ns = local_timers ? getLocalNextTimerNs(shared_timers) : getNextTimerNs(); // 获取下一个超时的定时器(ns)
+                    // 注意：这里的epoll_wait的超时时间，用从超时时间堆中取出了一开始超时的定时器的时间(向上取整到ms)和epoll_wait原生超时时间5000ms进行一个min的比较。
+                    uint64_t next_timeout = next_ns == ~0ull ? ~0ull : (next_ns + 999999) / 1000000;
+                    next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+                    // epoll_wait只有毫秒精度，由timerfd在定时器到期的精确时刻唤醒，epoll_wait的超时只作为兜底
+                    if(next_ns != 0 && next_ns < MAX_TIMEOUT * 1000000)
+                    {
+                        armTimerFd(next_ns, local_timers ? poller_index : -1);
+                    }
+
+                    // epoll_wait陷入阻塞，等待tickle信号的唤醒，
+                    // 并且使用了定时器堆中最早超时的定时器作为epoll_wait超时时间。
+                    rt = epoll_wait(wait_fd, events.get(), MAX_EVNETS, (int)next_timeout);
+                    // EINTR -> retry
+                    if(rt < 0 && errno == EINTR) // rt小于0代表无限阻塞，errno是EINTR(表示信号中断)
+                    {
+                        continue;
+                    }
+                    else
+                    {
+                        break;
+                    }
+                };
+                if(poller)
+                {
+                    poller->sleeping.store(false, std::memory_order_relaxed);
+                }
+                else
+                {
+                    m_sleepingThreads.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+
+            // 发现就绪的时间，记在被唤醒的协程上统计唤醒延迟；同时是本轮处理的开始
+            uint64_t loop_start = NowNs();
+            // 忙轮询的空轮询不进直方图，否则统计本身就成了空转的主要开销
+            bool record = !busy || rt > 0;
+            if(record)
+            {
+                m_waitTime.record(loop_start - wait_start);
+                m_eventsPerWait.record(rt > 0 ? rt : 0);
+            }
+
+            // 本轮timerfd是否报告了到期
+            bool timer_fired = false;
+
+            // collect all events ready
+            // 遍历所有的rt，代表有多少个事件准备了。
+            for (int i = 0; i < rt; ++i)
+            {
+                epoll_event& event = events[i]; // 获取第 i 个 epoll_event，用于处理该事件。
+
+                // tickle event
+                // 检查当前事件是否是 tickle 事件（即用于唤醒空闲线程的事件）。
+                if (event.data.fd == m_tickleFd) // 检查事件是否来自eventfd
+                {
+                    // 一次read就把计数清零
+                    uint64_t dummy;
+                    read(m_tickleFd, &dummy, sizeof(dummy));
+                    continue; // 跳过后续事件处理
+                }
+
+                // 每线程epoll模式：本线程的唤醒，以及共享的m_epfd上有事件
+                if (poller && event.data.fd == poller->tickleFd)
+                {
+                    uint64_t dummy;
+                    read(poller->tickleFd, &dummy, sizeof(dummy));
+                    continue;
+                }
+                if (poller && event.data.fd == m_epfd)
+                {
+                    // 不阻塞地取出共享事件追加到本轮数组末尾，由这个循环接着处理；放不下的留到下一轮(m_epfd是水平触发注册的)
+                    int n = epoll_wait(m_epfd, events.get() + rt, MAX_EVNETS - rt, 0);
+                    if (n > 0)
+                    {
+                        rt += n;
+                    }
+                    continue;
+                }
+
+                // timerfd event
+                // 到期的定时器在循环结束后由listExpiredCb收集，这里只需要清空timerfd的计数
+                if (event.data.fd == m_timerFd)
+                {
+                    uint64_t expirations;
+                    while (read(m_timerFd, &expirations, sizeof(expirations)) > 0);
+                    timer_fired = true;
+                    continue;
+                }
+                if (local_timers && event.data.fd == poller->timerFd)
+                {
+                    uint64_t expirations;
+                    while (read(poller->timerFd, &expirations, sizeof(expirations)) > 0);
+                    timer_fired = true;
+                    continue;
+                }
+
+                // io_uring completion
+                if (m_uring && event.data.fd == m_uring->getFd())
+                {
+                    reapUring(loop_start);
+                    continue;
+                }
+
+                // other events
+                // 通过 event.data.ptr 获取与当前事件关联的 FdContext 指针 fd_ctx，该指针包含了与文件描述符相关的上下文信息。
+                FdContext *fd_ctx = (FdContext *)event.data.ptr;
+                std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+
+                // 持久注册的fd：不修改epoll。有协程等待的方向直接触发，没有等待者的方向记为就绪
+                if (fd_ctx->registered)
+                {
+                    int happened = NONE;
+                    if (event.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    {
+                        happened |= READ;
+                    }
+                    if (event.events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    {
+                        happened |= WRITE;
+                    }
+                    fd_ctx->ready |= happened & ~fd_ctx->events;
+                    // 出错或挂断时重试都会失败，不会再把就绪交给下一个，所以唤醒全部等待者
+                    bool all = (event.events & (EPOLLERR | EPOLLHUP)) != 0;
+                    if (happened & fd_ctx->events & READ)
+                    {
+                        m_pendingEventCount -= fd_ctx->triggerEvent(READ, loop_start, all);
+                    }
+                    if (happened & fd_ctx->events & WRITE)
+                    {
+                        m_pendingEventCount -= fd_ctx->triggerEvent(WRITE, loop_start, all);
+                    }
+                    continue;
+                }
+
+                // convert EPOLLERR or EPOLLHUP to -> read or write event
+                // 如果当前事件是错误或挂起（EPOLLERR 或 EPOLLHUP），则将其转换为可读或可写事件（EPOLLIN 或 EPOLLOUT），以便后续处理。
+                // 这时重试都会失败，不会再把就绪交给下一个，所以唤醒全部等待者
+                bool all = (event.events & (EPOLLERR | EPOLLHUP)) != 0;
+                if (all)
+                {
+                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                }
+                // events happening during this turn of epoll_wait
+                // 确定实际发生的事件类型（读取、写入或两者）。
+                int real_events = NONE;
+                if (event.events & EPOLLIN)
+                {
+                    real_events |= READ;
+                }
+                if (event.events & EPOLLOUT)
+                {
+                    real_events |= WRITE;
+                }
+
+                real_events &= fd_ctx->events;
+                if (real_events == NONE)
+                {
+                    continue;
+                }
+
+                // schedule callback and update fdcontext and event context
+                // 触发事件，事件的执行。只唤醒一个等待者的方向上还有其他等待者时，该方向保持注册
+                int old_events = fd_ctx->events;
+                if (real_events & READ)
+                {
+                    m_pendingEventCount -= fd_ctx->triggerEvent(READ, loop_start, all);
+                }
+                if (real_events & WRITE)
+                {
+                    m_pendingEventCount -= fd_ctx->triggerEvent(WRITE, loop_start, all);
+                }
+
+                // delete the events that have already happened
+                // 没有等待者了的方向从epoll中去掉，剩余的方向仍然是边缘触发，不需要重新注册
+                int left_events = fd_ctx->events;
+                if (left_events == old_events)
+                {
+                    continue;
+                }
+                int op          = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+                //如果left_event没有事件了那么就只剩下边缘触发了events设置了
+                event.events    = EPOLLET | left_events;
+
+                // 根据之前计算的操作（op），调用 epoll_ctl 更新或删除 epoll 监听，如果失败，打印错误并继续处理下一个事件。
+                int rt2 = epollCtl(epfdOf(fd_ctx), op, fd_ctx->fd, &event);
+                if (rt2)
+                {
+                    std::cerr << "idle::epoll_ctl failed: " << strerror(errno) << std::endl;
+                }
+            } // end for
+
+            // collect all timers overdue
+            // 忙轮询空转时只在timerfd报告到期后才检查定时器
+            if(!busy || !spinning || timer_fired)
+            {
+                std::vector<std::function<void()>> cbs; // 用于存储超时的回调函数。
+                // 用来获取所有超时的定时器回调，并将它们添加到 cbs 向量中。
+                if(local_timers)
+                {
+                    listLocalExpiredCb(cbs, shared_timers);
+                }
+                else
+                {
+                    listExpiredCb(cbs);
+                }
+                if(!cbs.empty())
+                {
+                    for(const auto& cb : cbs)
+                    {
+                        scheduleLock(cb);
+                    }
+                    cbs.clear();
+                }
+            }
+
+            if(record)
+            {
+                m_loopTime.record(NowNs() - loop_start);
+            }
+
+            // 忙轮询：没有新任务(tickle没有推进)时不让出，继续轮询
+            if(busy)
+            {
+                uint64_t tickles = m_busyTickles.load(std::memory_order_acquire);
+                if(tickles == seen_tickles && !recheck)
+                {
+                    spinning = true;
+                    continue;
+                }
+                seen_tickles = tickles;
+                spinning = false;
+            }
 
             // 当前线程的协程主动让出控制权，调度器可以选择执行其他任务或再次进入 idle 状态。
             Fiber::GetThis()->yield();
 
-        } // end while(true)
+        } // end while(true)
+    }
+
+    void IOManager::armTimerFd(uint64_t ns, int poller)
+    {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        uint64_t deadline = now + ns;
+
+        // 线程自己的timerfd只由它自己设置，共享的timerfd加锁
+        int fd = m_timerFd;
+        uint64_t* armed = &m_timerFdDeadline;
+        std::unique_lock<std::mutex> lock(m_timerFdMutex, std::defer_lock);
+        if(poller >= 0)
+        {
+            fd = m_pollers[poller]->timerFd;
+            armed = &m_pollers[poller]->timerFdDeadline;
+        }
+        else
+        {
+            lock.lock();
+        }
+        // 已经设置了一个更早且尚未到期的时间，它到期后醒来的线程会重新计算
+        if(*armed > now && *armed <= deadline)
+        {
+            return;
+        }
+
+        itimerspec spec = {};
+        spec.it_value.tv_sec  = deadline / 1000000000;
+        spec.it_value.tv_nsec = deadline % 1000000000;
+        if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr))
+        {
+            std::cerr << "armTimerFd::timerfd_settime failed: " << strerror(errno) << std::endl;
+            return;
+        }
+        *armed = deadline;
+    }
+
+    bool IOManager::uringSubmitAndWait(const io_uring_sqe& op, uint64_t timeout, int& res)
+    {
+        if(!m_uring)
+        {
+            return false;
+        }
+
+        UringWaiter waiter;
+        waiter.fiber = Fiber::GetThis();
+        waiter.scheduler = Scheduler::GetThis();
+        // 链接超时的时间，内核在提交时读取，协程挂起期间一直有效
+        __kernel_timespec ts = {};
+        // 操作针对的fd(openat的AT_FDCWD等不算)，在途期间计数，供close判断是否需要取消
+        FdContext* fd_ctx = op.fd >= 0 ? m_fdManager->lookup(op.fd, true) : nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_uring->sqMutex);
+
+            // 带超时的操作需要连续的两个SQE，空间不够时先把已有的提交给内核
+            unsigned need = timeout == (uint64_t)-1 ? 1 : 2;
+            if(m_uring->space() < need)
+            {
+                m_uring->submit();
+                if(m_uring->space() < need)
+                {
+                    return false;
+                }
+            }
+
+            if(fd_ctx)
+            {
+                fd_ctx->uringOps.fetch_add(1, std::memory_order_acq_rel);
+            }
+            io_uring_sqe* sqe = m_uring->getSqe();
+            *sqe = op;
+            sqe->user_data = (uint64_t)&waiter;
+
+            if(timeout != (uint64_t)-1)
+            {
+                sqe->flags |= IOSQE_IO_LINK;
+                ts.tv_sec  = timeout / 1000000000;
+                ts.tv_nsec = timeout % 1000000000;
+
+                io_uring_sqe* tsqe = m_uring->getSqe();
+                tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+                tsqe->fd = -1;
+                tsqe->addr = (uint64_t)&ts;
+                tsqe->len = 1;
+                tsqe->user_data = (uint64_t)&waiter | URING_TIMEOUT_TAG;
+                waiter.pending = 2;
+            }
+
+            ++m_pendingEventCount;
+
+            // 平时等到idle时批量提交，攒得太多时立即提交
+            if(m_uring->unsubmitted() >= URING_BATCH)
+            {
+                m_uring->submit();
+            }
+        }
+
+        // 完成事件可能已经在别的线程上被收割，waiter.fiber随之被取走，不能再通过它yield
+        Fiber::GetThis()->yield();
+        if(fd_ctx)
+        {
+            fd_ctx->uringOps.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        res = waiter.res;
+        // 链接的超时到期时，操作以-ECANCELED结束；close取消的操作也是-ECANCELED，由超时自己的完成事件区分两者
+        if(res == -ECANCELED && waiter.timedOut)
+        {
+            res = -ETIMEDOUT;
+        }
+        return true;
+    }
+
+    void IOManager::uringCancel(int fd, int file_fd)
+    {
+        if(!m_uring)
+        {
+            return;
+        }
+
+        // 大多数close的fd上没有提交给io_uring的操作，不必为它们进入内核、争用提交队列的锁
+        FdContext* fd_ctx = m_fdManager->lookup(fd, false);
+        if(!fd_ctx)
+        {
+            return;
+        }
+        if(fd_ctx->uringOps.load(std::memory_order_acquire) == 0)
+        {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            if(!fd_ctx->multishot)
+            {
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_uring->sqMutex);
+        io_uring_sqe* sqe = m_uring->getSqe();
+        if(!sqe)
+        {
+            m_uring->submit();
+            sqe = m_uring->getSqe();
+            if(!sqe)
+            {
+                std::cerr << "uringCancel: submission queue is full, fd = " << fd << std::endl;
+                return;
+            }
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = file_fd >= 0 ? file_fd : fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = 0;
+        // 取消需要在close之前生效，立即提交
+        m_uring->submit();
+    }
+
+    void IOManager::reapUring(uint64_t ready_time)
+    {
+        m_uring->reap([this, ready_time](const io_uring_cqe& cqe)
+        {
+            // 取消请求自己的完成事件
+            if(cqe.user_data == 0)
+            {
+                return;
+            }
+
+            if(cqe.user_data & URING_MULTISHOT_TAG)
+            {
+                UringStream* stream = (UringStream*)(cqe.user_data & ~URING_MULTISHOT_TAG);
+                // 请求结束时释放内核持有的引用，等到这里处理完再析构
+                std::shared_ptr<UringStream> last;
+                std::shared_ptr<Fiber> fiber;
+                Scheduler* scheduler = nullptr;
+                bool drop = false;
+                {
+                    std::lock_guard<std::mutex> lock(stream->mutex);
+                    if(!(cqe.flags & IORING_CQE_F_MORE))
+                    {
+                        last.swap(stream->self);
+                    }
+                    if(stream->fiber)
+                    {
+                        fiber.swap(stream->fiber);
+                        scheduler = stream->scheduler;
+                        --m_pendingEventCount;
+                    }
+                    if(stream->closed && !fiber)
+                    {
+                        drop = true;
+                    }
+                    else
+                    {
+                        stream->results.emplace_back(cqe.res, cqe.flags);
+                    }
+                }
+                if(drop)
+                {
+                    uringDropResult(stream->opcode, cqe.res, cqe.flags);
+                }
+                if(fiber)
+                {
+                    fiber->setReadyTime(ready_time);
+                    scheduler->scheduleLock(&fiber);
+                }
+                return;
+            }
+
+            // 收割在m_cqMutex下串行进行，同一个waiter的两个完成事件不会被并发处理
+            UringWaiter* waiter = (UringWaiter*)(cqe.user_data & ~URING_TIMEOUT_TAG);
+            if(cqe.user_data & URING_TIMEOUT_TAG)
+            {
+                // 超时到期为-ETIME；操作先完成(或者被取消)时超时被撤销，为-ECANCELED
+                waiter->timedOut = cqe.res == -ETIME;
+            }
+            else
+            {
+                waiter->res = cqe.res;
+            }
+            if(--waiter->pending > 0)
+            {
+                return;
+            }
+            std::shared_ptr<Fiber> fiber = std::move(waiter->fiber);
+            Scheduler* scheduler = waiter->scheduler;
+            --m_pendingEventCount;
+            fiber->setReadyTime(ready_time);
+            // 调度之后协程可能马上恢复运行，栈上的waiter随之失效，之后不能再访问它
+            scheduler->scheduleLock(&fiber);
+        });
+    }
+
+    int IOManager::uringAccept(int fd)
+    {
+        int res;
+        uint32_t flags;
+        if(uringWaitMultishot(fd, IORING_OP_ACCEPT, res, flags))
+        {
+            return -1;
+        }
+        if(res < 0)
+        {
+            errno = -res;
+            return -1;
+        }
+        m_fdManager->create(res);
+        return res;
+    }
+
+    ssize_t IOManager::uringRecv(int fd, UringBuffer& buf)
+    {
+        UringBufferRing* ring = bufferRing();
+        if(!ring)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        int res;
+        uint32_t flags;
+        if(uringWaitMultishot(fd, IORING_OP_RECV, res, flags))
+        {
+            return -1;
+        }
+        if(res <= 0)
+        {
+            // 没有数据时内核不会取缓冲区，以防万一也还回去
+            if(flags & IORING_CQE_F_BUFFER)
+            {
+                ring->recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if(res < 0)
+            {
+                errno = -res;
+                return -1;
+            }
+            return 0;
+        }
+
+        buf.bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        buf.data = ring->getBuffer(buf.bid);
+        buf.len = res;
+        return res;
+    }
+
+    void IOManager::uringReleaseBuffer(UringBuffer& buf)
+    {
+        if(buf.bid >= 0 && m_bufRing)
+        {
+            m_bufRing->recycle(buf.bid);
+        }
+        buf = UringBuffer();
+    }
+
+    UringBufferRing* IOManager::bufferRing()
+    {
+        std::call_once(m_bufRingOnce, [this]()
+        {
+            if(!m_uring)
+            {
+                return;
+            }
+            std::unique_ptr<UringBufferRing> ring(new UringBufferRing());
+            if(ring->init(*m_uring, URING_BUF_GROUP, URING_BUF_COUNT, URING_BUF_SIZE))
+            {
+                m_bufRing = std::move(ring);
+            }
+        });
+        return m_bufRing.get();
+    }
+
+    int IOManager::uringWaitMultishot(int fd, uint8_t opcode, int& res, uint32_t& flags)
+    {
+        if(!m_uring)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        FdContext* fd_ctx = m_fdManager->lookup(fd, true);
+        if(!fd_ctx)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        std::shared_ptr<UringStream> stream;
+        {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            if(!fd_ctx->multishot)
+            {
+                fd_ctx->multishot = std::make_shared<UringStream>();
+                fd_ctx->multishot->opcode = opcode;
+                fd_ctx->multishot->manager = this;
+            }
+            stream = fd_ctx->multishot;
+        }
+        if(stream->opcode != opcode || stream->manager != this)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        std::unique_lock<std::mutex> lock(stream->mutex);
+        while(stream->results.empty())
+        {
+            if(stream->closed)
+            {
+                errno = EBADF;
+                return -1;
+            }
+            if(stream->fiber)
+            {
+                errno = EBUSY;
+                return -1;
+            }
+
+            // 上一个请求已经结束(或者还没有提交过)，提交一个新的
+            if(!stream->self)
+            {
+                std::lock_guard<std::mutex> sq_lock(m_uring->sqMutex);
+                io_uring_sqe* sqe = m_uring->getSqe();
+                if(!sqe)
+                {
+                    m_uring->submit();
+                    sqe = m_uring->getSqe();
+                    if(!sqe)
+                    {
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                }
+                sqe->opcode = opcode;
+                sqe->fd = fd;
+                sqe->user_data = (uint64_t)stream.get() | URING_MULTISHOT_TAG;
+                if(opcode == IORING_OP_ACCEPT)
+                {
+                    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+                }
+                else
+                {
+                    // 不给缓冲区，数据到达时由内核从缓冲池中选
+                    sqe->ioprio = IORING_RECV_MULTISHOT;
+                    sqe->flags = IOSQE_BUFFER_SELECT;
+                    sqe->buf_group = m_bufRing->getGroup();
+                }
+                stream->self = stream;
+
+                if(m_uring->unsubmitted() >= URING_BATCH)
+                {
+                    m_uring->submit();
+                }
+            }
+
+            stream->fiber = Fiber::GetThis();
+            stream->scheduler = Scheduler::GetThis();
+            ++m_pendingEventCount;
+            lock.unlock();
+            Fiber::GetThis()->yield();
+            lock.lock();
+        }
+
+        res = stream->results.front().first;
+        flags = stream->results.front().second;
+        stream->results.pop_front();
+        return 0;
+    }
+
+    void IOManager::uringDetach(FdContext* fd_ctx)
+    {
+        if(!m_uring)
+        {
+            return;
+        }
+
+        std::shared_ptr<UringStream> stream;
+        {
+            std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+            stream.swap(fd_ctx->multishot);
+        }
+        if(!stream)
+        {
+            return;
+        }
+
+        // 请求已经由uringCancel取消，挂起的协程会收到-ECANCELED
+        std::deque<std::pair<int, uint32_t>> results;
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->closed = true;
+            results.swap(stream->results);
+        }
+        for(auto& r : results)
+        {
+            uringDropResult(stream->opcode, r.first, r.second);
+        }
+    }
+
+    void IOManager::uringDropResult(uint8_t opcode, int res, uint32_t flags)
+    {
+        if(opcode == IORING_OP_ACCEPT)
+        {
+            if(res >= 0)
+            {
+                close(res);
+            }
+        }
+        else if((flags & IORING_CQE_F_BUFFER) && m_bufRing)
+        {
+            m_bufRing->recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+    }
+
+    int IOManager::listenReusePort(const sockaddr* addr, socklen_t addrlen, std::function<void(int fd)> cb, int backlog)
+    {
+        // 端口为0时由第一个socket决定端口，其余socket绑定到同一个地址
+        sockaddr_storage bound;
+        memcpy(&bound, addr, std::min<size_t>(addrlen, sizeof(bound)));
+
+        // use_caller时主线程要到stop()才进入调度，有其他工作线程时不给它分配socket，否则分到它那里的连接会一直积压
+        std::vector<int> threads;
+        for (int thread : getThreadIds())
+        {
+            if (thread != getRootThread() || getThreadIds().size() == 1)
+            {
+                threads.push_back(thread);
+            }
+        }
+        std::vector<int> fds;
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (fd < 0
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+                || bind(fd, (sockaddr*)&bound, addrlen)
+                || ::listen(fd, backlog))
+            {
+                int err = errno;
+                std::cerr << "listenReusePort failed: " << strerror(err) << std::endl;
+                if (fd >= 0)
+                {
+                    fds.push_back(fd);
+                }
+                for (int f : fds)
+                {
+                    close(f);
+                }
+                errno = err;
+                return -1;
+            }
+            if (i == 0)
+            {
+                socklen_t len = addrlen;
+                getsockname(fd, (sockaddr*)&bound, &len);
+            }
+            fds.push_back(fd);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_listenerMutex);
+            m_listeners.insert(m_listeners.end(), fds.begin(), fds.end());
+        }
+        // 只有每线程epoll模式下固定线程才有意义：监听socket和收到的连接都由该线程的epoll实例轮询。
+        // 共享epoll时固定线程反而要把每次唤醒转交给指定线程，所以不固定
+        bool pin = (m_mode & MODE_EPOLL_PER_THREAD) != 0;
+        for (size_t i = 0; i < fds.size(); ++i)
+        {
+            int fd = fds[i];
+            int thread = pin ? threads[i] : -1;
+            scheduleLock([this, fd, thread, cb]() { acceptLoop(fd, thread, cb); }, thread);
+        }
+        return 0;
+    }
+
+    void IOManager::stopListening()
+    {
+        std::vector<int> fds;
+        {
+            std::lock_guard<std::mutex> lock(m_listenerMutex);
+            fds.swap(m_listeners);
+        }
+        // shutdown之后accept返回EINVAL，正在等待的accept循环被cancelEvent唤醒后自己关闭socket
+        for (int fd : fds)
+        {
+            shutdown(fd, SHUT_RDWR);
+            cancelEvent(fd, READ);
+        }
+    }
+
+    void IOManager::runBlocking(const std::function<void()>& fn)
+    {
+        std::call_once(m_blockingOnce, [this]()
+        {
+            for (size_t i = 0; i < BLOCKING_THREADS; ++i)
+            {
+                m_blockingThreads.push_back(std::make_shared<Thread>(std::bind(&IOManager::blockingLoop, this),
+                                                                     getName() + "_blocking_" + std::to_string(i)));
+            }
+        });
+
+        BlockingCall call;
+        call.fn = &fn;
+        call.fiber = Fiber::GetThis();
+        ++m_pendingEventCount; // 调用执行完之前调度器不能停止
+        {
+            std::lock_guard<std::mutex> lock(m_blockingMutex);
+            m_blockingCalls.push_back(&call);
+        }
+        m_blockingCond.notify_one();
+
+        // 调用可能已经执行完、协程已经重新加入调度，call.fiber随之被取走，不能再通过它yield
+        Fiber::GetThis()->yield();
+    }
+
+    void IOManager::blockingLoop()
+    {
+        while (true)
+        {
+            BlockingCall* call;
+            {
+                std::unique_lock<std::mutex> lock(m_blockingMutex);
+                m_blockingCond.wait(lock, [this]() { return m_blockingStop || !m_blockingCalls.empty(); });
+                if (m_blockingCalls.empty())
+                {
+                    return;
+                }
+                call = m_blockingCalls.front();
+                m_blockingCalls.pop_front();
+            }
+
+            (*call->fn)();
+            // 协程恢复后call所在的栈帧随时可能失效，先把协程取出来
+            std::shared_ptr<Fiber> fiber = std::move(call->fiber);
+            scheduleLock(&fiber);
+            --m_pendingEventCount;
+        }
+    }
+
+    void IOManager::acceptLoop(int fd, int thread, const std::function<void(int fd)>& cb)
+    {
+        while (true)
+        {
+            // 原始的accept4：新连接在下面按accept循环的语义交给FdManager
+            int client = accept4_f(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                m_accepted.fetch_add(1, std::memory_order_relaxed);
+                m_fdManager->create(client);
+                std::function<void()> task = std::bind(cb, client);
+                scheduleLock(task, thread);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                break;
+            }
+
+            // 等待新连接。每线程epoll模式下事件由本线程的epoll实例触发，协程也回到本线程
+            int rt = addEvent(fd, READ);
+            if (rt == 0)
+            {
+                Fiber::GetThis()->yield();
+            }
+            else if (rt < 0)
+            {
+                break;
+            }
+        }
+
+        // 监听socket已经被stopListening关闭
+        cancelAll(fd);
+        m_fdManager->del(fd);
+        close(fd);
     }
 
     // 函数的作用是在定时器被插入到最前面时，触发tickle事件，唤醒阻塞的epoll_wait回收超时的定时任务(回调cb和协程)放入协程调度器中等待调度。
-    void IOManager::onTimerInsertedAtFront()
+    void IOManager::onTimerInsertedAtFront(size_t shard)
     {
+        // 分片各自唤醒：只唤醒负责这个分片的线程，0号分片由绑定0号实例的线程负责
+        if(m_localTimers)
+        {
+            Poller* target = shard == 0 ? m_pollers[0].get() : nullptr;
+            for(size_t i = 0; !target && i < m_pollers.size(); ++i)
+            {
+                if(m_pollers[i]->timerShard.load(std::memory_order_relaxed) == (int)shard)
+                {
+                    target = m_pollers[i].get();
+                }
+            }
+            int thread = target ? target->threadId.load(std::memory_order_relaxed) : -1;
+            if(thread >= 0)
+            {
+                tickleThread(thread);
+                return;
+            }
+        }
         tickle();
     }
 
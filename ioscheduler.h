@@ -3,9 +3,42 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "fd_manager.h"
+
+#include <sys/socket.h>
+#include <deque>
+
+struct io_uring_sqe;
+struct epoll_event;
 
 namespace sylar {
 
+    class IoUring;
+    class UringBufferRing;
+
+    // IOManager事件循环的统计快照。计数都是累计值，两次快照相减再除以time的差值即为速率；时间的单位都是ns。
+    // 忙轮询模式下没有任何事件的轮询只计入getEmptyPolls()，不进直方图
+    struct IOStats
+    {
+        // 快照时间
+        std::chrono::steady_clock::time_point time;
+        // addEvent/delEvent/cancelEvent/cancelAll的调用次数，以及实际发出的epoll_ctl次数
+        uint64_t addEvents = 0;
+        uint64_t delEvents = 0;
+        uint64_t cancelEvents = 0;
+        uint64_t cancelAlls = 0;
+        uint64_t epollCtls = 0;
+        // 每次epoll_wait的耗时，包括阻塞等待的时间；count即epoll_wait的次数
+        Histogram::Snapshot waitTime;
+        // 每次epoll_wait返回的事件数(包括tickle、timerfd等内部事件)
+        Histogram::Snapshot eventsPerWait;
+        // 每轮循环处理就绪事件和收集到期定时器的时间，不含epoll_wait
+        Histogram::Snapshot loopTime;
+        // 唤醒延迟：从idle发现fd就绪(或io_uring操作完成)到等待它的协程真正恢复运行，主要是在调度队列中排队的时间。
+        // 只统计挂起等待的协程，addEvent注册回调函数的等待不计入
+        Histogram::Snapshot wakeupLatency;
+    };
+
     // work flow
     // 1 register one event -> 2 wait for it to ready -> 3 schedule the callback -> 4 unregister the event -> 5 run the callback
     // 1 注册事件 -> 2 等待事件 -> 3 事件触发调度回调 -> 4 注销事件回调后从epoll注销 -> 5 执行回调进入调度器中执行调度。
@@ -22,56 +55,137 @@ namespace sylar {
             WRITE = 0x4 // 表示写事件，对应于 epoll 的 EPOLLOUT 事件。
         };
 
-    private:
-        struct FdContext // 用于描述一个文件描述的事件上下文
+        // 构造时选择的工作模式，可以按位组合
+        enum Mode
         {
-            struct EventContext // 描述一个具体事件的上下文，如读事件或写事件。
-            {
-                // 三元组信息，分别是描述符-事件类型(可读可写事件)-回调函数
-                // scheduler
-                Scheduler *scheduler = nullptr; // 关联的调度器。
-                // callback fiber
-                std::shared_ptr<Fiber> fiber; // 关联的回调线程（协程）。
-                // callback function
-                std::function<void()> cb; // 关联的回调函数。
-            };
-
-            // read event context
-            EventContext read; // read和write表示读和写的上下文
-            // write event context
-            EventContext write;
-            int fd = 0; // 事件关联的fd(句柄)(文件描述符)
-            // events registered
-            Event events = NONE; // 当前注册的事件目前是没有事件，但可能变成 READ、WRITE 或二者的组合。
-            std::mutex mutex;
-
-            EventContext& getEventContext(Event event); // 根据事件类型获取相应的事件上下文（如读事件上下文或写事件上下文）。
-            void resetEventContext(EventContext &ctx); // 重置事件上下文。
-            void triggerEvent(Event event); // 触发事件。根据事件类型调用对应上下文结构的调度器去调度协程或函数
+            // 默认：epoll就绪通知，hook中收到EAGAIN后注册事件、挂起，就绪后重试系统调用
+            MODE_EPOLL = 0x0,
+            // hook中socket的读写、accept、connect作为io_uring的完成事件提交，协程挂起直到CQE到达；
+            // 内核不支持io_uring时自动退回epoll
+            MODE_IO_URING = 0x1,
+            // 持久注册：fd第一次等待时以EPOLLIN|EPOLLOUT|EPOLLET注册一次，直到close才注销，事件触发后不再epoll_ctl修改；
+            // 没有协程等待时到达的就绪状态记录在FdContext中，之后的addEvent直接返回1，协程不挂起而是立即重试。
+            // 要求fd通过hook的close关闭，以便注销
+            MODE_EPOLL_PERSISTENT = 0x2,
+            // 每个工作线程一个epoll实例：fd归第一个在它上面等待的工作线程所有，由该线程轮询并在本线程恢复等待的协程，
+            // 可以用migrateFd()转移。io_uring等共享的fd仍在m_epfd中，m_epfd和timerfd只注册在0号线程的epoll实例里
+            MODE_EPOLL_PER_THREAD = 0x4,
+            // 忙轮询：工作线程用0超时的epoll_wait空转，从不阻塞睡眠，tickle不需要系统调用；注册的socket设置SO_BUSY_POLL/SO_PREFER_BUSY_POLL。
+            // 每个工作线程都会占满一个核，应给这类IOManager单独的线程
+            MODE_BUSY_POLL = 0x8
         };
 
+        // 同一个fd、同一方向上有多个等待者时，就绪后唤醒哪些
+        enum WakeMode
+        {
+            // 唤醒全部等待者(默认)
+            WAKE_ALL = 0,
+            // 按等待的先后只唤醒一个；被唤醒的协程I/O结束后(成功或出错)由hook调用rearmEvent把机会交给下一个，避免惊群
+            WAKE_ONE = 1
+        };
+
+    private:
+        // 每个fd的事件上下文和hook的状态是同一条记录，由FdManager分配
+        typedef FdCtx FdContext;
+
     public:
         // threads线程数量，use_caller是否讲主线程或调度线程包含进行，name调度器的名字
-        IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager");
+        // mode工作模式，见Mode
+        IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager", int mode = MODE_EPOLL);
         ~IOManager();
 
         //事件管理方法
         // add one event at a time
-        int addEvent(int fd, Event event, std::function<void()> cb = nullptr); // 添加一个事件到文件描述符 fd 上，并关联一个回调函数 cb。
+        // 添加一个事件到文件描述符 fd 上，并关联一个回调函数 cb。成功返回0，失败返回-1；
+        // 持久注册模式下fd已经就绪时返回1，此时不注册事件，调用方应直接重试I/O。
+        // 同一方向上可以有多个等待者，按加入的先后排队，就绪时按setWakeMode设置的方式唤醒
+        int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
         // delete event
         bool delEvent(int fd, Event event); // 删除文件描述符fd上的某个事件
         // delete the event and trigger its callback
         bool cancelEvent(int fd, Event event); // 删除文件描述符fd上的某个事件，并触发其回调函数
         // delete all events and trigger its callback
-        bool cancelAll(int fd); // 删除所有文件描述符fd上的事件，并触发所有回调函数
+        bool cancelAll(int fd, int file_fd = -1); // 删除所有文件描述符fd上的事件，并触发所有回调函数
+        // 设置fd某个方向上多个等待者的唤醒方式，close(cancelAll)时恢复为WAKE_ALL
+        bool setWakeMode(int fd, Event event, WakeMode mode);
+        // 只取消协程fiber在fd某个方向上的等待并唤醒它，其他等待者不受影响(超时用)
+        bool cancelWait(int fd, Event event, const Fiber* fiber);
+        // WAKE_ONE方向上还有等待者时重新注册一次，fd仍然就绪就再唤醒下一个等待者
+        bool rearmEvent(int fd, Event event);
 
         static IOManager* GetThis();
 
+        // 是否启用了io_uring
+        bool hasUring() const {return m_uring != nullptr;}
+        // 把填好的SQE交给io_uring并挂起当前协程，直到它完成。SQE的user_data由这里设置。
+        // timeout超时时间(ns)，(uint64_t)-1表示不超时，超时通过链接的IORING_OP_LINK_TIMEOUT实现。
+        // 提交成功返回true，res是CQE的结果(失败时为-errno，超时为-ETIMEDOUT)；队列已满无法提交时返回false，调用方应退回epoll路径
+        bool uringSubmitAndWait(const io_uring_sqe& sqe, uint64_t timeout, int& res);
+        // 取消fd上所有还没完成的io_uring操作，被取消的操作以-ECANCELED完成。
+        // fd号已经被dup2/dup3覆盖时，file_fd是仍然指向原来那个文件的副本，内核按文件匹配要取消的操作
+        void uringCancel(int fd, int file_fd = -1);
+
+        // uringRecv从共享缓冲池中取到的一段数据。data直接指向池中的缓冲区，用完后必须调用uringReleaseBuffer归还
+        struct UringBuffer
+        {
+            char* data = nullptr;
+            size_t len = 0;
+            int bid = -1;
+        };
+        // io_uring模式下等待监听socket fd上的下一个连接。第一次调用时提交一个multishot accept，之后的连接都由它产生，
+        // 没有协程在等待时到达的连接排队留给下一次调用。返回非阻塞的新连接(已交给FdManager)，失败返回-1并设置errno。
+        // 以下两个函数要求fd通过hook的close关闭，以便取消multishot请求
+        int uringAccept(int fd);
+        // io_uring模式下等待fd上的下一段数据。第一次调用时提交一个multishot recv，数据到达时内核才从共享缓冲池中取缓冲区，
+        // 空闲的连接不占用缓冲区；buf指向池中的数据，不复制。返回数据长度，对端关闭返回0，失败返回-1并设置errno。
+        // 缓冲池耗尽时返回-1且errno为ENOBUFS，归还缓冲区后再次调用即可。同一个fd同时只能有一个协程等待
+        ssize_t uringRecv(int fd, UringBuffer& buf);
+        // 把uringRecv得到的缓冲区还给缓冲池
+        void uringReleaseBuffer(UringBuffer& buf);
+
+        // tickle时因为没有线程阻塞在epoll_wait中而省掉的eventfd写次数，以及实际写的次数
+        uint64_t getTickleSkipped() const {return m_tickleSkipped.load(std::memory_order_relaxed);}
+        uint64_t getTickleWritten() const {return m_tickleWritten.load(std::memory_order_relaxed);}
+
+        // 忙轮询模式的统计：轮询次数、其中没有任何事件的次数，以及从构造开始平均每秒轮询次数和空轮询比例。
+        // 各线程每轮询1024次合并一次计数
+        uint64_t getPollIterations() const {return m_pollIterations.load(std::memory_order_relaxed);}
+        uint64_t getEmptyPolls() const {return m_emptyPolls.load(std::memory_order_relaxed);}
+        double getPollRate() const;
+        double getEmptyPollRatio() const;
+
+        // 事件循环的统计快照，见IOStats
+        IOStats getIOStats() const;
+        // 清空IOStats中的直方图，累计计数不受影响
+        void resetIOStats();
+
+        // 为每个工作线程在addr上打开一个SO_REUSEPORT的监听socket，由内核把新连接分散到各个socket上(use_caller的主线程除外，除非只有它)。
+        // 每个socket有自己的accept循环，收到的连接(非阻塞，已交给FdManager)以新任务调用cb；每线程epoll模式下accept循环和cb都固定在该socket的线程上。
+        // addr的端口为0时所有socket使用第一个socket绑定到的端口。成功返回0，失败返回-1并设置errno
+        int listenReusePort(const sockaddr* addr, socklen_t addrlen, std::function<void(int fd)> cb, int backlog = SOMAXCONN);
+        // 关闭listenReusePort打开的所有监听socket，accept循环随之退出。析构时自动调用
+        void stopListening();
+        // accept循环收到的连接总数
+        uint64_t getAccepted() const {return m_accepted.load(std::memory_order_relaxed);}
+
+        // 在阻塞线程池中执行fn(阻塞的系统调用，比如没有io_uring时普通文件的读写)，当前协程挂起直到fn执行完。
+        // 线程池在第一次调用时启动，析构时停止；fn中的errno等线程局部状态需要自己带回
+        void runBlocking(const std::function<void()>& fn);
+
+        // 每线程epoll模式下把fd交给线程id为thread的工作线程轮询，之后它的事件在该线程上唤醒等待的协程。
+        // 已经注册的事件一并转移到目标线程的epoll实例；目标线程还没有绑定epoll实例时返回false
+        bool migrateFd(int fd, int thread);
+
         // 也就是说idle收集到了就yield退出，然后通知调度器来调度
     protected:
         // 通知调度器有任务调度
-        // 写pipe让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务.
+        // 写eventfd让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务.
+        // 没有线程阻塞在epoll_wait中时不写，这些线程在睡眠前会自己检查任务队列
         void tickle() override;
+        // 任务指定了线程时只唤醒那个线程；每线程epoll模式下线程就是调用方自己时不需要唤醒
+        void tickleThread(int thread) override;
+        // 记录唤醒延迟
+        void onFiberReady(uint64_t ready_time) override;
 
         // 判断调度器是否可以停止
         // 判断条件是Scheduler::stopping()外加IOManager的m_pendingEventCount为0，表示没有IO事件可调度
@@ -80,18 +194,120 @@ namespace sylar {
         // 实际上idle协程只负责收集所有已触发的fd的回调函数并将其加入调度器的任务队列，真正的执行时机是idle协程退出后，调度器在下一轮调度时执行
         void idle() override; // 这里也是scheduler的重写，当没有事件处理时，线程处于空闲状态时的处理逻辑。
 
-        void onTimerInsertedAtFront() override; // Timer类的成员函数重写，当有新的定时器插入到前面时的处理逻辑
+        // Timer类的成员函数重写，当有新的定时器插入到前面时的处理逻辑。分片各自唤醒时只唤醒负责该分片的线程
+        void onTimerInsertedAtFront(size_t shard) override;
+
+        // 将timerfd设置为ns纳秒后到期，用于亚毫秒精度地唤醒epoll_wait。
+        // poller不为-1时设置该epoll实例自己的timerfd，只由绑定它的线程调用，不加锁
+        void armTimerFd(uint64_t ns, int poller = -1);
+
+        // 收割io_uring的完成事件，唤醒对应的协程。ready_time是发现完成的时间，用于统计唤醒延迟
+        void reapUring(uint64_t ready_time);
+
+        // 计数的epoll_ctl，IOManager中所有的epoll_ctl都经过这里
+        int epollCtl(int epfd, int op, int fd, epoll_event* event);
+        // 等待fd上opcode类型(IORING_OP_ACCEPT或IORING_OP_RECV)的multishot请求的下一个结果，请求已经结束时重新提交。
+        // 成功返回0，res和flags来自CQE；失败返回-1并设置errno
+        int uringWaitMultishot(int fd, uint8_t opcode, int& res, uint32_t& flags);
+        // close时解除fd上的multishot请求，丢弃还没被取走的结果
+        void uringDetach(FdContext* fd_ctx);
+        // 丢弃一个没有人取走的结果：关闭收到的连接，归还缓冲区
+        void uringDropResult(uint8_t opcode, int res, uint32_t flags);
+        // 共享缓冲池，第一次uringRecv时创建，内核不支持时为空
+        UringBufferRing* bufferRing();
 
-        void contextResize(size_t size); // 调整文件描述符上下文数组的大小。
+        // 阻塞线程池的线程函数，直到析构时停止
+        void blockingLoop();
+
+        // 一个监听socket的accept循环，直到监听socket被关闭。thread为-1时不固定线程
+        void acceptLoop(int fd, int thread, const std::function<void(int fd)>& cb);
+
+        // 当前工作线程绑定一个独占的epoll实例，返回它在m_pollers中的下标；不是每线程epoll模式、不是本调度器的线程或实例用完时返回-1。
+        // idle和addEvent都会调用，线程在第一次进入idle之前等待的fd也归它自己
+        int bindPoller();
+        void unbindPoller();
+        // fd当前注册所在的epoll实例
+        int epfdOf(const FdContext *fd_ctx) const;
 
     private:
+        // 每线程epoll模式下一个工作线程独占的epoll实例
+        struct Poller
+        {
+            int epfd = -1;
+            // 只唤醒这个线程的eventfd
+            int tickleFd = -1;
+            // 绑定的工作线程id
+            std::atomic<int> threadId = {-1};
+            // 是否已经决定阻塞(或正在阻塞)在epoll_wait中，tickle时用exchange认领，同一次睡眠只写一次
+            std::atomic<bool> sleeping = {false};
+            // 定时器分片各自唤醒时这个线程自己的timerfd，以及它当前设置的到期时间(ns，system_clock纪元)
+            int timerFd = -1;
+            uint64_t timerFdDeadline = 0;
+            // 绑定的线程负责的定时器分片下标，-1表示还没有绑定
+            std::atomic<int> timerShard = {-1};
+        };
+
+        // 交给阻塞线程池的一次调用，放在发起调用的协程栈上
+        struct BlockingCall
+        {
+            const std::function<void()>* fn = nullptr;
+            std::shared_ptr<Fiber> fiber;
+        };
+
         int m_epfd = 0; // 用于epoll的文件描述符。
-        // fd[0] read，fd[1] write; int rt = pipe(m_tickleFds);创建管道
-        int m_tickleFds[2]; // 用于线程间通信的管道文件描述符，fd[0] 是读端，fd[1] 是写端。
+        // 用于唤醒epoll_wait的eventfd，计数累加不会像pipe那样写满
+        int m_tickleFd = -1;
+        // 已经决定阻塞(或正在阻塞)在epoll_wait中的线程数
+        std::atomic<size_t> m_sleepingThreads = {0};
+        std::atomic<uint64_t> m_tickleSkipped = {0};
+        std::atomic<uint64_t> m_tickleWritten = {0};
+        // 忙轮询模式：tickle推进的计数，空转的线程看到变化就让出去取任务
+        std::atomic<uint64_t> m_busyTickles = {0};
+        std::atomic<uint64_t> m_pollIterations = {0};
+        std::atomic<uint64_t> m_emptyPolls = {0};
+        std::chrono::steady_clock::time_point m_createTime = std::chrono::steady_clock::now();
+        // 事件循环统计，见IOStats
+        std::atomic<uint64_t> m_addEventCalls = {0};
+        std::atomic<uint64_t> m_delEventCalls = {0};
+        std::atomic<uint64_t> m_cancelEventCalls = {0};
+        std::atomic<uint64_t> m_cancelAllCalls = {0};
+        std::atomic<uint64_t> m_epollCtlCalls = {0};
+        Histogram m_waitTime;
+        Histogram m_eventsPerWait;
+        Histogram m_loopTime;
+        Histogram m_wakeupLatency;
+        // 注册在m_epfd(每线程epoll模式下是0号实例)中的timerfd。epoll_wait的超时只有毫秒精度，定时器由timerfd按纳秒精度唤醒
+        int m_timerFd = -1;
+        std::mutex m_timerFdMutex;
+        // timerfd当前设置的绝对到期时间(ns，system_clock纪元)，避免多个线程重复设置
+        uint64_t m_timerFdDeadline = 0;
         std::atomic<size_t> m_pendingEventCount = {0}; // 原子计数器，用于记录待处理的事件数量。使用atomic的好处是这个变量再进行加或-都是不会被多线程影响
-        std::shared_mutex m_mutex; // 读写锁
         // store fdcontexts for each fd
-        std::vector<FdContext *> m_fdContexts; // 文件描述符上下文数组，用于存储每个文件描述符的 FdContext。
+        // 每个fd的记录所在的表，查找不加锁
+        FdManager* m_fdManager = nullptr;
+        // 工作模式
+        int m_mode = MODE_EPOLL;
+        // io_uring实例，没有启用时为空。ring的fd注册在m_epfd中，有完成事件时唤醒epoll_wait
+        std::unique_ptr<IoUring> m_uring;
+        // multishot recv共享的缓冲池
+        std::once_flag m_bufRingOnce;
+        std::unique_ptr<UringBufferRing> m_bufRing;
+        // listenReusePort打开、还在监听的socket
+        std::mutex m_listenerMutex;
+        std::vector<int> m_listeners;
+        std::atomic<uint64_t> m_accepted = {0};
+        // 每线程epoll模式下各工作线程的epoll实例，构造后不再改变大小
+        std::vector<std::unique_ptr<Poller>> m_pollers;
+        std::atomic<size_t> m_nextPoller = {0};
+        // 每线程epoll模式(忙轮询除外)：定时器分片各自唤醒，每个线程只等待和收集自己的分片，0号实例的线程还负责共享分片
+        bool m_localTimers = false;
+        // runBlocking的线程池和等待执行的调用
+        std::once_flag m_blockingOnce;
+        std::mutex m_blockingMutex;
+        std::condition_variable m_blockingCond;
+        std::deque<BlockingCall*> m_blockingCalls;
+        bool m_blockingStop = false;
+        std::vector<std::shared_ptr<Thread>> m_blockingThreads;
     };
 
 } // end namespace sylar
@@ -127,6 +127,7 @@ namespace sylar {
 		{
 			task.reset();
 			bool tickle_me = false; // 是否唤醒了其他线程进行任务调度
+			int pinned_thread = -1; // 跳过的、固定给其他线程的任务的目标线程
 
 			{
 				std::lock_guard<std::mutex> lock(m_mutex);
@@ -136,8 +137,8 @@ namespace sylar {
 				{
 					if(it->thread!=-1 && it->thread!=thread_id)
 					{
+						pinned_thread = it->thread;
 						it++;
-						tickle_me = true;
 						continue;
 					}
 
@@ -148,9 +149,14 @@ namespace sylar {
 					m_activeThreadCount++;
 					break; // 这里取到任务的线程就直接break所以并没有遍历到队尾
 				}
-				tickle_me = tickle_me || (it != m_tasks.end()); // 确保仍然存在未处理的任务
+				tickle_me = it != m_tasks.end(); // 确保仍然存在未处理的任务
 			}
 
+			// 固定给其他线程的任务只能由那个线程执行，唤醒它本身，而不是随便一个空闲线程
+			if(pinned_thread != -1)
+			{
+				tickleThread(pinned_thread);
+			}
 			if(tickle_me) // 这里虽然写了唤醒但并没有具体的逻辑代码，具体的在io+scheduler
 			{
 				tickle();
@@ -163,6 +169,11 @@ namespace sylar {
 					std::lock_guard<std::mutex> lock(task.fiber->m_mutex);
 					if(task.fiber->getState()!=Fiber::TERM)
 					{
+						uint64_t ready_time = task.fiber->takeReadyTime();
+						if(ready_time)
+						{
+							onFiberReady(ready_time);
+						}
 						task.fiber->resume();
 					}
 				}
@@ -172,6 +183,7 @@ namespace sylar {
 			else if(task.cb) // 执行回调函数（封装为临时协程）
 			{ // 上面解释过对于函数也应该被调度，具体做法就封装成协程加入调度。
 				std::shared_ptr<Fiber> cb_fiber = std::make_shared<Fiber>(task.cb);
+				cb_fiber->setDeadline(task.deadline);
 				{
 					std::lock_guard<std::mutex> lock(cb_fiber->m_mutex);
 					cb_fiber->resume();
@@ -70,7 +70,14 @@ namespace sylar {
 
     		if(need_tickle) // 如果检查出了队列为空，就唤醒线程
     		{
-    			tickle();
+    			if(thread == -1)
+    			{
+    				tickle();
+    			}
+    			else
+    			{
+    				tickleThread(thread);
+    			}
     		}
 	    }
 
@@ -82,6 +89,10 @@ namespace sylar {
 	protected:
 		// 唤醒线程
 		virtual void tickle();
+		// 唤醒指定的线程，默认和tickle()一样
+		virtual void tickleThread(int /*thread*/) {tickle();}
+		// 被I/O事件唤醒的协程即将恢复运行，ready_time是发现就绪的时间(steady_clock纳秒)
+		virtual void onFiberReady(uint64_t /*ready_time*/) {}
 
 		/**
 		 * @brief 工作线程主循环
@@ -104,6 +115,34 @@ namespace sylar {
 		// 当调度协程进入idle时空闲线程数+1，从idle协程返回时空闲 线程数减1；
 		bool hasIdleThreads() {return m_idleThreadCount>0;}
 
+		// 工作线程的id，包括use_caller时的主线程
+		const std::vector<int>& getThreadIds() const {return m_threadIds;}
+		// use_caller时主线程的id，否则为-1
+		int getRootThread() const {return m_rootThread;}
+
+		// 任务队列中是否还有任务
+		bool hasPendingTasks()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return !m_tasks.empty();
+		}
+
+		// 任务队列中是否有当前线程能执行的任务：不限线程的，或者固定给当前线程的。
+		// 固定给其他线程的任务由run()唤醒那个线程去取，当前线程不必为它们保持清醒
+		bool hasRunnableTasks()
+		{
+			int thread_id = Thread::GetThreadId();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for(const ScheduleTask& task : m_tasks)
+			{
+				if(task.thread == -1 || task.thread == thread_id)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
 	private:
 
 		/**
@@ -120,6 +159,7 @@ namespace sylar {
 			std::shared_ptr<Fiber> fiber; // 协程智能指针（自动管理生命周期）
 			std::function<void()> cb; // 函数回调
 			int thread; // 目标线程ID
+			uint64_t deadline = 0; // 回调任务继承的截止时间，来自调度它的协程
 
 			ScheduleTask()
 			{
@@ -144,12 +184,14 @@ namespace sylar {
 			{
 				cb = f;
 				thread = thr;
+				deadline = Fiber::GetThisDeadline();
 			}
 
 			ScheduleTask(std::function<void()>* f, int thr)
 			{
 				cb.swap(*f); // 同理
 				thread = thr;
+				deadline = Fiber::GetThisDeadline();
 			}
 
 			void reset() // 重置
@@ -157,6 +199,7 @@ namespace sylar {
 				fiber = nullptr;
 				cb = nullptr;
 				thread = -1;
+				deadline = 0;
 			}
 		};
 
@@ -0,0 +1,109 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+namespace sylar {
+
+// 以2的幂为桶边界的直方图，用于统计延迟之类跨越多个数量级的数值。
+// record()只有几次relaxed原子操作，可以在任意线程的热路径上调用；snapshot()读到的是近似一致的结果。
+class Histogram
+{
+public:
+    // 0号桶只放0，i号桶放[2^(i-1), 2^i)，最后一个桶收纳所有更大的值
+    static const size_t BUCKETS = 64;
+
+    struct Snapshot
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t buckets[BUCKETS] = {0};
+
+        uint64_t mean() const {return count ? sum / count : 0;}
+
+        // 百分位数(p取0~1)，返回所在桶的上界，误差不超过2倍
+        uint64_t percentile(double p) const
+        {
+            if(count == 0)
+            {
+                return 0;
+            }
+            uint64_t target = (uint64_t)(p * count);
+            if(target >= count)
+            {
+                target = count - 1;
+            }
+            uint64_t seen = 0;
+            for(size_t i = 0; i < BUCKETS; ++i)
+            {
+                seen += buckets[i];
+                if(seen > target)
+                {
+                    return i == 0 ? 0 : std::min<uint64_t>(((uint64_t)1 << i) - 1, max);
+                }
+            }
+            return max;
+        }
+    };
+
+    Histogram() {reset();}
+
+    void record(uint64_t value)
+    {
+        m_buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t cur = m_max.load(std::memory_order_relaxed);
+        while(value > cur && !m_max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        for(size_t i = 0; i < BUCKETS; ++i)
+        {
+            s.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        }
+        s.count = m_count.load(std::memory_order_relaxed);
+        s.sum = m_sum.load(std::memory_order_relaxed);
+        s.max = m_max.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    void reset()
+    {
+        for(size_t i = 0; i < BUCKETS; ++i)
+        {
+            m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static size_t bucketOf(uint64_t value)
+    {
+        if(value == 0)
+        {
+            return 0;
+        }
+        size_t index = 64 - __builtin_clzll(value);
+        return index < BUCKETS ? index : BUCKETS - 1;
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+}
+
+#endif
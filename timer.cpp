@@ -1,27 +1,154 @@
 #include "timer.h"
 
+#include <algorithm>
+#include <mutex>
+
 namespace sylar {
 
-    // 这个函数的主要目的是取消一个定时器，删除该定时器的回调函数并将其从定时器管理器中移除。
-    bool Timer::cancel()
+    // 空闲块链表节点，直接复用空闲块本身的内存
+    struct TimerPoolBlock
+    {
+        TimerPoolBlock* next;
+    };
+
+    // 每次向系统申请的块数，以及线程缓存的上限（超出部分归还全局链表，供其他线程使用）
+    static const size_t POOL_CHUNK_BLOCKS = 64;
+    static const size_t POOL_LOCAL_LIMIT = POOL_CHUNK_BLOCKS * 2;
+
+    static std::mutex s_pool_mutex;
+    static TimerPoolBlock* s_pool_free = nullptr;
+
+    // Timer可能在A线程创建、在B线程释放，块先回到释放线程的本地链表
+    struct TimerPoolCache
     {
-        // 写锁互斥锁unique_lock+shared_mutex
-        std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+        TimerPoolBlock* free = nullptr;
+        size_t count = 0;
 
-        if(m_cb == nullptr) // 如果为空，说明该定时器已经被取消或未初始化
+        // 线程退出时把缓存的块还给全局链表，否则每个退出的线程都会带走最多POOL_LOCAL_LIMIT个块
+        ~TimerPoolCache()
         {
-            return false;
+            if(!free)
+            {
+                return;
+            }
+            TimerPoolBlock* last = free;
+            while(last->next)
+            {
+                last = last->next;
+            }
+            std::lock_guard<std::mutex> lock(s_pool_mutex);
+            last->next = s_pool_free;
+            s_pool_free = free;
+            free = nullptr;
+            count = 0;
         }
-        else
+    };
+    static thread_local TimerPoolCache t_pool;
+
+    void* TimerPool::Allocate()
+    {
+        TimerPoolBlock*& t_pool_free = t_pool.free;
+        size_t& t_pool_count = t_pool.count;
+        if(!t_pool_free)
         {
-            m_cb = nullptr; // 回调函数如果存在设置为nullptr
+            std::lock_guard<std::mutex> lock(s_pool_mutex);
+            if(!s_pool_free)
+            {
+                // 池中的内存只增不减，申请到的整片内存在进程退出前不会释放
+                char* chunk = static_cast<char*>(::operator new(BLOCK_SIZE * POOL_CHUNK_BLOCKS));
+                for(size_t i = 0; i < POOL_CHUNK_BLOCKS; ++i)
+                {
+                    TimerPoolBlock* block = reinterpret_cast<TimerPoolBlock*>(chunk + i * BLOCK_SIZE);
+                    block->next = s_pool_free;
+                    s_pool_free = block;
+                }
+            }
+            // 从全局链表批量取一批到本线程，减少加锁次数
+            while(s_pool_free && t_pool_count < POOL_CHUNK_BLOCKS)
+            {
+                TimerPoolBlock* block = s_pool_free;
+                s_pool_free = block->next;
+                block->next = t_pool_free;
+                t_pool_free = block;
+                ++t_pool_count;
+            }
         }
 
-        auto it = m_manager->m_timers.find(shared_from_this()); // 从定时管理器中找到需要删除的定时器
-        // shared_from_this() 返回的 std::shared_ptr 指向当前对象（即调用 shared_from_this() 的 Timer 对象）
-        if(it!=m_manager->m_timers.end())
+        TimerPoolBlock* block = t_pool_free;
+        t_pool_free = block->next;
+        --t_pool_count;
+        return block;
+    }
+
+    void TimerPool::Deallocate(void* p)
+    {
+        TimerPoolBlock*& t_pool_free = t_pool.free;
+        size_t& t_pool_count = t_pool.count;
+        TimerPoolBlock* block = static_cast<TimerPoolBlock*>(p);
+        block->next = t_pool_free;
+        t_pool_free = block;
+        ++t_pool_count;
+
+        if(t_pool_count > POOL_LOCAL_LIMIT)
         {
-            m_manager->m_timers.erase(it); // 删除定时器
+            // 本线程缓存过多，归还一半给全局链表
+            std::lock_guard<std::mutex> lock(s_pool_mutex);
+            while(t_pool_count > POOL_CHUNK_BLOCKS)
+            {
+                TimerPoolBlock* back = t_pool_free;
+                t_pool_free = back->next;
+                back->next = s_pool_free;
+                s_pool_free = back;
+                --t_pool_count;
+            }
+        }
+    }
+
+    // 惰性定时器的超时时间以纳秒整数保存在原子变量中，这两个函数负责和time_point互相转换
+    static int64_t ToNs(const std::chrono::time_point<std::chrono::system_clock>& tp)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+    }
+
+    static std::chrono::time_point<std::chrono::system_clock> FromNs(int64_t ns)
+    {
+        return std::chrono::time_point<std::chrono::system_clock>(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(ns)));
+    }
+
+    // 这个函数的主要目的是取消一个定时器，删除该定时器的回调函数并将其从定时器管理器中移除。
+    bool Timer::cancel()
+    {
+        // 取消的是全局最早的定时器时，共享的最早时间要重新计算，否则事件循环会在它原来的时间空醒一次
+        bool was_min = false;
+        {
+            // 写锁互斥锁unique_lock+shared_mutex
+            std::unique_lock<std::shared_mutex> write_lock(m_shard->mutex);
+
+            if(m_cb == nullptr) // 如果为空，说明该定时器已经被取消或未初始化
+            {
+                return false;
+            }
+            else
+            {
+                m_cb = nullptr; // 回调函数如果存在设置为nullptr
+                m_lazyNext.store(0, std::memory_order_relaxed);
+                ++m_shard->cancelled;
+            }
+
+            // 定时器记录了自己在堆中的下标，直接删除，不需要查找
+            if(m_heapIndex != (size_t)-1)
+            {
+                // 分片各自唤醒时没有共享的最早时间
+                was_min = !m_manager->m_localWakeup && m_heapIndex == 0 && m_shard->topNs.load() <= m_manager->m_minNext.load();
+                m_shard->erase(m_heapIndex);
+                m_shard->publishTop();
+            }
+        }
+
+        if(was_min)
+        {
+            m_manager->recomputeMinNext();
         }
         return true;
     }
@@ -29,78 +156,166 @@ namespace sylar {
     // 刷新定时器超时时间，这个刷新操作会将定时器的下次触发延后。
     bool Timer::refresh()
     {
-        std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+        if(m_lazy)
+        {
+            // 惰性刷新：只记录新的超时时间，由管理器在它到达堆顶时处理。
+            // 用CAS写入，和cancel()或触发时写入的0竞争：已经取消或触发的定时器不会被刷新"复活"
+            int64_t next = ToNs(std::chrono::system_clock::now() + m_interval.load(std::memory_order_relaxed));
+            int64_t cur = m_lazyNext.load(std::memory_order_relaxed);
+            do
+            {
+                if(cur == 0)
+                {
+                    return false;
+                }
+            } while(!m_lazyNext.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+            return true;
+        }
+
+        std::unique_lock<std::shared_mutex> write_lock(m_shard->mutex);
 
         if(!m_cb)
         {
             return false;
         }
 
-        auto it = m_manager->m_timers.find(shared_from_this()); // 同上
-        if(it==m_manager->m_timers.end())
+        if(m_heapIndex == (size_t)-1) // 不在堆中
         {
             return false;
         }
 
-        m_manager->m_timers.erase(it);
-        m_next = std::chrono::system_clock::now() + std::chrono::milliseconds(m_ms);
+        m_next = std::chrono::system_clock::now() + m_interval.load(std::memory_order_relaxed);
         // std::chrono::system_clock::now()是C++中用来获取当前系统时间的标准方法，返回的时间是系统(绝对时间)，通常用于记录当前的实际时间点。
 
-        m_manager->m_timers.insert(shared_from_this());
+        // 超时时间只会变晚，原地下沉即可
+        m_shard->reschedule(m_heapIndex);
+        m_shard->publishTop();
         return true;
     }
 
     bool Timer::reset(uint64_t ms, bool from_now)
     {
-        if(ms==m_ms && !from_now) // 检查是否要重置
+        return reset(std::chrono::milliseconds(ms), from_now);
+    }
+
+    bool Timer::reset(std::chrono::nanoseconds interval, bool from_now)
+    {
+        if(interval==m_interval.load(std::memory_order_relaxed) && !from_now) // 检查是否要重置
         {
             return true;
         }
-        // 如果不满足上面的条件需要重置，删除当前的定时器然后重新计算超时时间并重新插入定时器
+        // 如果不满足上面的条件需要重置，重新计算超时时间并调整定时器在堆中的位置
 
+        bool at_front = false;
         {
-            std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+            std::unique_lock<std::shared_mutex> write_lock(m_shard->mutex);
 
             if(!m_cb) // 如果为空，说明该定时器已经被取消或未初始化，因此无法重置
             {
                 return false;
             }
 
-            auto it = m_manager->m_timers.find(shared_from_this());
-            if(it==m_manager->m_timers.end())
+            if(m_heapIndex == (size_t)-1)
             {
                 return false;
             }
-            m_manager->m_timers.erase(it);
+
+            if(m_lazy) // 以refresh()记录的最新时间为准
+            {
+                m_next = FromNs(m_lazyNext.load(std::memory_order_relaxed));
+            }
+            auto start = from_now ? std::chrono::system_clock::now() : m_next - m_interval.load(std::memory_order_relaxed);
+            m_interval.store(interval, std::memory_order_relaxed);
+            m_next = start + interval;
+            if(m_lazy)
+            {
+                m_lazyNext.store(ToNs(m_next), std::memory_order_relaxed);
+            }
+            m_shard->reschedule(m_heapIndex);
+
+            // 超时时间可能提前成为最早的定时器，需要和addTimer一样唤醒
+            at_front = m_manager->publishShardTop(m_shard);
         }
 
-        // reinsert
-        auto start = from_now ? std::chrono::system_clock::now() : m_next - std::chrono::milliseconds(m_ms);
-        m_ms = ms;
-        m_next = start + std::chrono::milliseconds(m_ms);
-        m_manager->addTimer(shared_from_this()); // insert with lock
+        if(at_front)
+        {
+            m_manager->onTimerInsertedAtFront(m_shard->index);
+        }
         return true;
     }
 
-    // Timer构造函数
-    Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager):
-    m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager)
+    void Timer::restart(std::chrono::nanoseconds timeout, TimerCallback cb)
     {
-        auto now = std::chrono::system_clock::now(); // 记录当前绝对时间
-        m_next = now + std::chrono::milliseconds(m_ms); // 下一次绝对超时时间
+        restart(timeout, std::move(cb), std::weak_ptr<void>(), false);
     }
 
-    // 从小到大排序
-    bool Timer::Comparator::operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const
+    void Timer::restart(std::chrono::nanoseconds timeout, TimerCallback cb, std::weak_ptr<void> weak_cond)
     {
-        assert(lhs!=nullptr&&rhs!=nullptr);
-        return lhs->m_next < rhs->m_next;
+        restart(timeout, std::move(cb), std::move(weak_cond), true);
     }
 
+    void Timer::restart(std::chrono::nanoseconds timeout, TimerCallback cb, std::weak_ptr<void> weak_cond, bool conditional)
+    {
+        bool at_front = false;
+        {
+            std::unique_lock<std::shared_mutex> write_lock(m_shard->mutex);
+
+            m_cb = std::move(cb);
+            m_cond = std::move(weak_cond);
+            m_conditional = conditional;
+            m_interval.store(timeout, std::memory_order_relaxed);
+            m_next = std::chrono::system_clock::now() + timeout;
+            if(m_lazy)
+            {
+                m_lazyNext.store(ToNs(m_next), std::memory_order_relaxed);
+            }
+
+            // 还在堆中就原地调整位置，否则重新入堆
+            if(m_heapIndex != (size_t)-1)
+            {
+                m_shard->reschedule(m_heapIndex);
+            }
+            else
+            {
+                m_shard->push(shared_from_this());
+                ++m_shard->inserted;
+            }
+
+            at_front = m_manager->publishShardTop(m_shard);
+        }
+
+        if(at_front)
+        {
+            m_manager->onTimerInsertedAtFront(m_shard->index);
+        }
+    }
+
+    // Timer构造函数
+    Timer::Timer(std::chrono::nanoseconds interval, TimerCallback cb, bool recurring, TimerManager* manager, std::chrono::nanoseconds slack):
+    m_recurring(recurring), m_interval(interval), m_slack(slack), m_cb(std::move(cb)), m_manager(manager), m_managerId(manager->getId())
+    {
+        auto now = std::chrono::system_clock::now(); // 记录当前绝对时间
+        m_next = now + interval; // 下一次绝对超时时间
+    }
+
+    // 当前线程绑定的定时器管理器和分片
+    static thread_local TimerManager* t_timer_manager = nullptr;
+    static thread_local TimerShard* t_timer_shard = nullptr;
+
+    // 下一个定时器管理器的编号
+    static std::atomic<uint64_t> s_timer_manager_id = {1};
+
     // 初始化当前系统时间，为后续检查系统时间错误时进行校对。
-    TimerManager::TimerManager()
+    TimerManager::TimerManager(size_t shards): m_id(s_timer_manager_id.fetch_add(1))
     {
-        m_previouseTime = std::chrono::system_clock::now();
+        m_previouseTime = ToNs(std::chrono::system_clock::now());
+
+        m_shards.resize(std::max<size_t>(shards, 1));
+        for(size_t i = 0; i < m_shards.size(); ++i)
+        {
+            m_shards[i].reset(new TimerShard());
+            m_shards[i]->index = i;
+        }
     }
 
     TimerManager::~TimerManager()
@@ -108,15 +323,43 @@ namespace sylar {
     }
 
     // 将一个新定时器添加到定时器管理器中，并在必要时唤醒管理中的线程，准确的来说是在ioscheduler类的阻塞中的epoll，以确保定时器能够及时触发后执行回调函数。
-    std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring)
+    std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, TimerCallback cb, bool recurring, uint64_t slack)
+    {
+        return addTimer(std::chrono::milliseconds(ms), std::move(cb), recurring,
+                        slack == (uint64_t)-1 ? std::chrono::nanoseconds(-1) : std::chrono::milliseconds(slack));
+    }
+
+    std::shared_ptr<Timer> TimerManager::addTimer(std::chrono::nanoseconds interval, TimerCallback cb, bool recurring, std::chrono::nanoseconds slack)
+    {
+        if(slack.count() < 0)
+        {
+            slack = std::chrono::nanoseconds(m_defaultSlack);
+        }
+        // Timer和引用计数的控制块一起从定时器池中分配
+        std::shared_ptr<Timer> timer = std::allocate_shared<Timer>(TimerAllocator<Timer>(), interval, std::move(cb), recurring, this, slack);
+        timer->m_shard = localShard();
+        addTimer(timer);
+        return timer;
+    }
+
+    std::shared_ptr<Timer> TimerManager::addLazyTimer(uint64_t ms, TimerCallback cb)
+    {
+        return addLazyTimer(std::chrono::milliseconds(ms), std::move(cb));
+    }
+
+    std::shared_ptr<Timer> TimerManager::addLazyTimer(std::chrono::nanoseconds interval, TimerCallback cb)
     {
-        std::shared_ptr<Timer> timer(new Timer(ms, cb, recurring, this));
+        std::shared_ptr<Timer> timer = std::allocate_shared<Timer>(TimerAllocator<Timer>(), interval, std::move(cb), false, this,
+                                                                   std::chrono::nanoseconds(m_defaultSlack));
+        timer->m_shard = localShard();
+        timer->m_lazy = true;
+        timer->m_lazyNext.store(ToNs(timer->m_next), std::memory_order_relaxed);
         addTimer(timer);
         return timer;
     }
 
     // 如果条件存在 -> 执行cb()
-    static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
+    static void OnTimer(const std::weak_ptr<void>& weak_cond, const TimerCallback& cb)
     {
         // 弱引用提升检查条件有效性
         std::shared_ptr<void> tmp = weak_cond.lock();
@@ -126,129 +369,543 @@ namespace sylar {
         }
     }
 
+    // 定时器的一次触发：listExpiredCb把回调、条件和计划触发时间从Timer中取出来放进定时器池的一个块里，
+    // 交给调度器的std::function只捕获指向它的指针，能放进std::function的内部缓冲区，触发的路径上不调用malloc
+    struct TimerFiring
+    {
+        TimerCallback cb;
+        std::weak_ptr<void> cond;
+        bool conditional;
+        // 计划触发的时间(ns)，回调开始执行时据此记录延迟，这样在调度队列中排队的时间也算在内
+        int64_t scheduled;
+        Histogram* lateness;
+
+        // 执行回调，然后把自己还给定时器池
+        static void Run(TimerFiring* firing)
+        {
+            int64_t late = ToNs(std::chrono::system_clock::now()) - firing->scheduled;
+            firing->lateness->record(late > 0 ? (uint64_t)late : 0);
+            if(firing->conditional)
+            {
+                OnTimer(firing->cond, firing->cb);
+            }
+            else
+            {
+                firing->cb();
+            }
+            firing->~TimerFiring();
+            TimerPool::Deallocate(firing);
+        }
+    };
+    static_assert(sizeof(TimerFiring) <= TimerPool::BLOCK_SIZE, "TimerFiring must fit in a pool block");
+
     // 条件定时器实现
-    // 添加一个条件定时器，并在定时器触发的时候执行的cb的会触发OnTimer，在OnTimer中会真正触发任务。
-    std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring)
+    // 条件直接保存在Timer的m_cond中，触发时在listExpiredCb里放进TimerFiring由OnTimer检查，添加定时器时不再额外分配bind对象。
+    std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, TimerCallback cb, std::weak_ptr<void> weak_cond, bool recurring, uint64_t slack)
     {
+        return addConditionTimer(std::chrono::milliseconds(ms), std::move(cb), std::move(weak_cond), recurring,
+                                 slack == (uint64_t)-1 ? std::chrono::nanoseconds(-1) : std::chrono::milliseconds(slack));
+    }
+
+    std::shared_ptr<Timer> TimerManager::addConditionTimer(std::chrono::nanoseconds interval, TimerCallback cb, std::weak_ptr<void> weak_cond, bool recurring, std::chrono::nanoseconds slack)
+    {
+        if(slack.count() < 0)
+        {
+            slack = std::chrono::nanoseconds(m_defaultSlack);
+        }
         // 通过weak_ptr绑定条件，避免循环引用
-        return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
-        // 将OnTimer的真正指向交给了第一个addtimer。然后创建timer对象。
+        std::shared_ptr<Timer> timer = std::allocate_shared<Timer>(TimerAllocator<Timer>(), interval, std::move(cb), recurring, this, slack);
+        timer->m_cond = std::move(weak_cond);
+        timer->m_conditional = true;
+        timer->m_shard = localShard();
+        addTimer(timer);
+        return timer;
     }
 
-    // 获取定时器管理器中下一个定时器的超时时间。
+    // 获取定时器管理器中下一个定时器的超时时间(ms)。
     uint64_t TimerManager::getNextTimer()
     {
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex); // 读锁
-
-        // reset m_tickled
-        // 重置为未通知状态
-        m_tickled = false;
+        uint64_t ns = getNextTimerNs();
+        if(ns == ~0ull)
+        {
+            return ~0ull;
+        }
+        // 向上取整：剩余0.3ms时返回1而不是0，否则epoll_wait会以0超时反复空转直到定时器到期
+        return (ns + 999999) / 1000000;
+    }
 
-        if (m_timers.empty())
+    // 从现在到绝对时间next(ns)还有多久，next为INT64_MAX(没有定时器)时返回~0ull
+    static uint64_t NsUntil(int64_t next)
+    {
+        if(next == INT64_MAX)
         {
             // 返回最大值（无效值）
             return ~0ull;
         }
 
-        auto now = std::chrono::system_clock::now(); // 获取当前系统时间
-        auto time = (*m_timers.begin())->m_next; // 获取最小时间堆中的第一个超时定时器判断超时
-
-        if(now>=time) // 判断当前时间是否已经超过了下一个定时器的超时时间
+        int64_t now = ToNs(std::chrono::system_clock::now()); // 获取当前系统时间
+        if(now >= next) // 判断当前时间是否已经超过了下一个定时器的超时时间
         {
             // 已经有timer超时
             return 0;
         }
-        else
+        //计算从当前时间到下一个定时器超时时间的时间差
+        return static_cast<uint64_t>(next - now);
+    }
+
+    // 获取定时器管理器中下一个定时器的超时时间(ns)。
+    // 只读共享的最早时间，不加锁，也不随分片(工作线程)数量增加开销
+    uint64_t TimerManager::getNextTimerNs()
+    {
+        if(m_localWakeup)
         {
-            //计算从当前时间到下一个定时器超时时间的时间差，结果是一个 std::chrono::milliseconds 对象
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(time - now);
+            // 分片各自唤醒时不维护共享的最早时间，看各分片的堆顶
+            int64_t next = INT64_MAX;
+            for(auto& shard : m_shards)
+            {
+                next = std::min(next, shard->topNs.load());
+            }
+            return NsUntil(next);
+        }
 
-            //将时间差转换为毫秒，并返回这个值。
-            return static_cast<uint64_t>(duration.count());
+        // reset tickled
+        // 重置为未通知状态。先重置再读最早时间：在这之后提前了最早时间的插入一定会再唤醒一次
+        m_tickled.store(false);
+        return NsUntil(m_minNext.load());
+    }
+
+    uint64_t TimerManager::getLocalNextTimerNs(bool with_shared)
+    {
+        TimerShard* shards[2];
+        localShards(with_shared, shards);
+        int64_t next = INT64_MAX;
+        for(TimerShard* shard : shards)
+        {
+            if(!shard)
+            {
+                continue;
+            }
+            // 先重置再读堆顶：在这之后提前了堆顶的修改一定会再通知一次
+            shard->tickled.store(false);
+            next = std::min(next, shard->topNs.load());
         }
+        return NsUntil(next);
     }
 
     // 处理超时定时器的函数，它的主要功能是将所有已经超时的定时器的回调函数收集到一个向量（cbs）中，并处理定时器的循环逻辑
     void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs)
     {
         auto now = std::chrono::system_clock::now();
-
-        std::unique_lock<std::shared_mutex> write_lock(m_mutex);
+        int64_t now_ns = ToNs(now);
 
         // 调用 detectClockRollover(now_ms) 检测系统时间是否发生了回滚（即时间被调后）。如果发生回滚，则认为所有定时器都已超时。
-        bool rollover = detectClockRollover();
+        bool rollover = detectClockRollover(now_ns, m_previouseTime);
+
+        // 所有分片的最早时间都还没到：不碰任何分片
+        if(!rollover && !m_localWakeup && m_minNext.load() > now_ns)
+        {
+            return;
+        }
+
+        for(auto& shard : m_shards)
+        {
+            // 先看一眼发布出来的堆顶时间，大部分分片没有到期的定时器，不需要加锁
+            if(!rollover && shard->topNs.load() > now_ns)
+            {
+                continue;
+            }
+            drainShard(shard.get(), now, rollover, cbs);
+        }
+
+        // 到期的都取走了，最早时间推后到剩下的定时器中最早的那个
+        if(!m_localWakeup)
+        {
+            recomputeMinNext();
+        }
+    }
+
+    void TimerManager::listLocalExpiredCb(std::vector<std::function<void()>>& cbs, bool with_shared)
+    {
+        auto now = std::chrono::system_clock::now();
+        int64_t now_ns = ToNs(now);
+
+        TimerShard* shards[2];
+        localShards(with_shared, shards);
+        for(TimerShard* shard : shards)
+        {
+            if(!shard)
+            {
+                continue;
+            }
+            // 每个分片只由一个线程收集，系统时间回退也按分片各自检查
+            bool rollover = detectClockRollover(now_ns, shard->previousNs);
+            if(!rollover && shard->topNs.load() > now_ns)
+            {
+                continue;
+            }
+            drainShard(shard, now, rollover, cbs);
+        }
+    }
+
+    void TimerManager::drainShard(TimerShard* shard, std::chrono::time_point<std::chrono::system_clock> now, bool rollover,
+                                  std::vector<std::function<void()>>& cbs)
+    {
+        auto& timers = shard->timers;
+        std::unique_lock<std::shared_mutex> write_lock(shard->mutex);
 
         // 回退 -> 清理所有timer || 超时 -> 清理超时timer,如果rollover为false就没发生系统时间回退
         // 如果时间回滚发生或者定时器的超时时间早于或等于当前时间，则需要处理这些定时器。为什么说早于或等于都要处理，因为超时时间都是基于now后的
-        while (!m_timers.empty() && rollover || !m_timers.empty() && (*m_timers.begin())->m_next <= now)
+        // 时间回退时堆里的定时器全部触发一次，循环定时器先摘下来，最后再放回去，避免被反复取出
+        std::vector<std::shared_ptr<Timer>> rearm;
+        while (!timers.empty() && (rollover || timers[0].next <= now))
         {
-            std::shared_ptr<Timer> temp = *m_timers.begin();
-            m_timers.erase(m_timers.begin());
+            std::shared_ptr<Timer> temp = timers[0].timer;
 
-            cbs.push_back(temp->m_cb); // 收集回调延迟执行（减少锁持有时间）
+            // 惰性定时器被refresh()推后了：按最新时间重新入堆，而不是触发
+            if(temp->m_lazy && !rollover)
+            {
+                int64_t seen = temp->m_lazyNext.load(std::memory_order_relaxed);
+                auto lazy_next = FromNs(seen);
+                if(lazy_next > temp->m_next)
+                {
+                    temp->m_next = lazy_next;
+                    shard->reschedule(0);
+                    continue;
+                }
+                // 只触发一次的：先把最新时间换成0再触发。换失败说明refresh()刚把它推后，重新检查堆顶，按新时间入堆
+                if(!temp->m_recurring && !temp->m_lazyNext.compare_exchange_strong(seen, 0, std::memory_order_relaxed))
+                {
+                    continue;
+                }
+            }
 
-            // 如果定时器是循环的,m_next 属性设置为当前时间加上定时器的间隔（m_ms），然后重新插入到定时器集合中。
-            if (temp->m_recurring) // 循环定时器重新插入
+            // 收集回调延迟执行（减少锁持有时间）
+            // 只触发一次的定时器不再需要自己的回调，直接移走；循环定时器复制一份，下次触发还要用
+            bool keep = temp->m_recurring;
+            TimerFiring* firing = new (TimerPool::Allocate()) TimerFiring{
+                keep ? temp->m_cb : std::move(temp->m_cb), keep ? temp->m_cond : std::move(temp->m_cond),
+                temp->m_conditional, ToNs(temp->m_next), &m_lateness};
+            cbs.push_back([firing]() {TimerFiring::Run(firing);});
+            ++shard->fired;
+
+            // 如果定时器是循环的,m_next 属性设置为当前时间加上定时器的间隔（m_interval），然后原地调整它在堆中的位置。
+            if (temp->m_recurring && !rollover) // 循环定时器重新入堆
             {
-                // 重新加入时间堆
-                temp->m_next = now + std::chrono::milliseconds(temp->m_ms);
-                m_timers.insert(temp); // 触发红黑树重新排序
+                temp->m_next = now + temp->m_interval.load(std::memory_order_relaxed);
+                shard->reschedule(0); // 堆顶下沉
             }
             else
             {
-                // 清理cb，防止悬空回调
-                temp->m_cb = nullptr;
+                shard->erase(0);
+                if(temp->m_recurring)
+                {
+                    temp->m_next = now + temp->m_interval.load(std::memory_order_relaxed);
+                    rearm.push_back(temp);
+                }
+                else
+                {
+                    // 清理cb，防止悬空回调
+                    temp->m_cb = nullptr;
+                    temp->m_lazyNext.store(0, std::memory_order_relaxed);
+                }
             }
         }
+        for(auto& timer : rearm)
+        {
+            shard->push(timer);
+        }
+        shard->publishTop();
     }
 
     // 查看超时时间堆是否为空
     bool TimerManager::hasTimer()
     {
-        std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-        return !m_timers.empty();
+        for(auto& shard : m_shards)
+        {
+            if(shard->topNs.load() != INT64_MAX)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    TimerStats TimerManager::getStats()
+    {
+        TimerStats stats;
+        stats.time = std::chrono::steady_clock::now();
+        for(auto& shard : m_shards)
+        {
+            std::shared_lock<std::shared_mutex> read_lock(shard->mutex);
+            stats.live += shard->timers.size();
+            stats.inserted += shard->inserted;
+            stats.cancelled += shard->cancelled;
+            stats.fired += shard->fired;
+            stats.tickles += shard->tickles;
+        }
+        stats.lateness = m_lateness.snapshot();
+        return stats;
     }
 
     // lock + tickle()
     void TimerManager::addTimer(std::shared_ptr<Timer> timer)
     {
+        TimerShard* shard = timer->m_shard;
         bool at_front = false; // 标识插入的是最早超时的定时器
         {
-            std::unique_lock<std::shared_mutex> write_lock(m_mutex);
+            std::unique_lock<std::shared_mutex> write_lock(shard->mutex);
 
-            //将定时器插入到 m_timers 集合中。由于 m_timers 是一个 std::set，插入时会自动按定时器的超时时间排序。
-            auto it = m_timers.insert(timer).first;
-            // 判断插入的定时器是否是集合超时时间中最早的定时器
-            at_front = (it == m_timers.begin()) && !m_tickled;
+            // 将定时器插入到时间堆中，并判断插入的定时器是否是所有分片中最早超时的定时器
+            shard->push(timer);
+            ++shard->inserted;
 
             // only tickle once till one thread wakes up and runs getNextTime()
-            if(at_front) // 标识有一个新的最早定时器被插入了，防止重复唤醒。
-            {
-                m_tickled = true;
-            }
+            at_front = publishShardTop(shard);
         }
 
         if(at_front)
         {
             // wake up
-            onTimerInsertedAtFront(); // 虚函数具体执行在ioscheduler
+            onTimerInsertedAtFront(shard->index); // 虚函数具体执行在ioscheduler
+        }
+    }
+
+    size_t TimerManager::bindTimerShard()
+    {
+        if(t_timer_manager != this)
+        {
+            // 分片用完(线程数超过构造时的估计)时退回共享分片
+            size_t index = m_nextShard.fetch_add(1);
+            t_timer_manager = this;
+            t_timer_shard = index < m_shards.size() ? m_shards[index].get() : m_shards[0].get();
         }
+        return t_timer_shard->index;
+    }
+
+    void TimerManager::unbindTimerShard()
+    {
+        if(t_timer_manager == this)
+        {
+            t_timer_manager = nullptr;
+            t_timer_shard = nullptr;
+        }
+    }
+
+    TimerShard* TimerManager::localShard()
+    {
+        return t_timer_manager == this ? t_timer_shard : m_shards[0].get();
+    }
+
+    void TimerManager::localShards(bool with_shared, TimerShard* shards[2])
+    {
+        shards[0] = localShard();
+        shards[1] = with_shared && shards[0] != m_shards[0].get() ? m_shards[0].get() : nullptr;
     }
 
     // 检测系统时间是否发生了回滚(即时间是否倒退)。
-    bool TimerManager::detectClockRollover()
+    // 每一轮事件循环都会调用，上次的时间用原子变量交换，不加锁
+    bool TimerManager::detectClockRollover(int64_t now_ns, std::atomic<int64_t>& previous)
     {
-        bool rollover = false;
-        // 当前时间 now 与上次记录的时间 m_previouseTime 减去一个小时的时间量 (60 * 60 * 1000 毫秒)。
-        // 当前时间 now 小于这个时间值，说明系统时间回滚了，因此将rollover设置为true
-        auto now = std::chrono::system_clock::now();
-        if(now < (m_previouseTime - std::chrono::milliseconds(60 * 60 * 1000)))
+        // 当前时间 now 与上次记录的时间 previous 减去一个小时的时间量 (60 * 60 * 1000 毫秒)。
+        // 当前时间 now 小于这个时间值，说明系统时间回滚了，因此返回true
+        int64_t last = previous.exchange(now_ns);
+        return now_ns < last - 60ll * 60 * 1000 * 1000 * 1000;
+    }
+
+    bool TimerManager::publishShardTop(TimerShard* shard)
+    {
+        if(m_localWakeup)
+        {
+            int64_t old_top = shard->topNs.load();
+            shard->publishTop();
+            // 堆顶没有提前；或者是负责这个分片的线程自己修改的，它正醒着，回到事件循环时会重新计算等待时间
+            if(shard->topNs.load() >= old_top || (shard->index != 0 && localShard() == shard))
+            {
+                return false;
+            }
+            // 负责的线程计算等待时间之后只通知一次
+            if(shard->tickled.exchange(true))
+            {
+                return false;
+            }
+            ++shard->tickles;
+            return true;
+        }
+
+        shard->publishTop();
+        if(!lowerMinNext(shard->topNs.load()))
         {
-            rollover = true;
+            return false;
         }
-        m_previouseTime = now;
-        return rollover;
+        // 标识有一个新的最早定时器被插入了，防止重复唤醒。
+        if(m_tickled.exchange(true))
+        {
+            return false;
+        }
+        ++shard->tickles;
+        return true;
+    }
+
+    bool TimerManager::lowerMinNext(int64_t ns)
+    {
+        int64_t cur = m_minNext.load();
+        while(ns < cur)
+        {
+            if(m_minNext.compare_exchange_weak(cur, ns))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void TimerManager::recomputeMinNext()
+    {
+        int64_t next = INT64_MAX;
+        for(auto& shard : m_shards)
+        {
+            next = std::min(next, shard->topNs.load());
+        }
+        m_minNext.store(next);
+        // 和插入并发时上面的store可能覆盖掉插入方刚降低的值。插入方先发布堆顶再降低最早时间，
+        // 这里先store再看一遍各分片的堆顶，两边至少有一方能看到对方的写入，所以不会漏掉
+        for(auto& shard : m_shards)
+        {
+            lowerMinNext(shard->topNs.load());
+        }
+    }
+
+    // 4叉堆：下标i的父节点为(i-1)/4，子节点为4i+1 ~ 4i+4。
+    // 相比二叉堆层数减半，下沉时4个孩子在数组中相邻，对缓存更友好。
+    static const size_t HEAP_ARITY = 4;
+
+    std::chrono::time_point<std::chrono::system_clock> TimerShard::bucketTime(const Timer& timer)
+    {
+        auto slack = std::chrono::duration_cast<std::chrono::system_clock::duration>(timer.m_slack);
+        if(slack.count() <= 0)
+        {
+            return timer.m_next;
+        }
+        // 以纪元为基准向上取整到slack的整数倍，同一个桶内的定时器排序键相同，会在同一次唤醒中一起触发
+        auto since_epoch = timer.m_next.time_since_epoch();
+        auto rounded = (since_epoch + slack - std::chrono::system_clock::duration(1)) / slack * slack;
+        return std::chrono::time_point<std::chrono::system_clock>(rounded);
+    }
+
+    std::chrono::time_point<std::chrono::system_clock> TimerShard::sortKey(const Timer& timer) const
+    {
+        auto next = bucketTime(timer);
+        // 比当前堆顶更早，但堆顶仍在它的容忍范围内：直接并入堆顶所在的时间桶。
+        // 事件循环本来就会在堆顶时间醒来，所以不需要为它再唤醒一次epoll_wait
+        if(!timers.empty() && next < timers[0].next
+            && timers[0].next <= timer.m_next + timer.m_slack)
+        {
+            next = timers[0].next;
+        }
+        return next;
+    }
+
+    bool TimerShard::push(const std::shared_ptr<Timer>& timer)
+    {
+        auto next = sortKey(*timer);
+        timer->m_heapIndex = timers.size();
+        timers.push_back({next, timer});
+        siftUp(timer->m_heapIndex);
+        return timer->m_heapIndex == 0;
+    }
+
+    void TimerShard::erase(size_t index)
+    {
+        assert(index < timers.size());
+        timers[index].timer->m_heapIndex = (size_t)-1;
+
+        // 用最后一个元素填补空位，再调整它的位置
+        size_t last = timers.size() - 1;
+        if(index != last)
+        {
+            timers[index] = std::move(timers[last]);
+            timers[index].timer->m_heapIndex = index;
+            timers.pop_back();
+            update(index);
+        }
+        else
+        {
+            timers.pop_back();
+        }
+    }
+
+    void TimerShard::reschedule(size_t index)
+    {
+        timers[index].next = sortKey(*timers[index].timer);
+        update(index);
+    }
+
+    void TimerShard::update(size_t index)
+    {
+        if(index > 0 && timers[index].next < timers[(index - 1) / HEAP_ARITY].next)
+        {
+            siftUp(index);
+        }
+        else
+        {
+            siftDown(index);
+        }
+    }
+
+    void TimerShard::publishTop()
+    {
+        topNs.store(timers.empty() ? INT64_MAX : ToNs(timers[0].next));
     }
 
-}
+    void TimerShard::siftUp(size_t index)
+    {
+        TimerHeapEntry entry = std::move(timers[index]);
+        while(index > 0)
+        {
+            size_t parent = (index - 1) / HEAP_ARITY;
+            if(!(entry.next < timers[parent].next))
+            {
+                break;
+            }
+            timers[index] = std::move(timers[parent]);
+            timers[index].timer->m_heapIndex = index;
+            index = parent;
+        }
+        entry.timer->m_heapIndex = index;
+        timers[index] = std::move(entry);
+    }
+
+    void TimerShard::siftDown(size_t index)
+    {
+        size_t size = timers.size();
+        TimerHeapEntry entry = std::move(timers[index]);
+        while(true)
+        {
+            size_t first = index * HEAP_ARITY + 1;
+            if(first >= size)
+            {
+                break;
+            }
+            // 在最多4个孩子中找最早超时的
+            size_t end = std::min(first + HEAP_ARITY, size);
+            size_t min_child = first;
+            for(size_t i = first + 1; i < end; ++i)
+            {
+                if(timers[i].next < timers[min_child].next)
+                {
+                    min_child = i;
+                }
+            }
+            if(!(timers[min_child].next < entry.next))
+            {
+                break;
+            }
+            timers[index] = std::move(timers[min_child]);
+            timers[index].timer->m_heapIndex = index;
+            index = min_child;
+        }
+        entry.timer->m_heapIndex = index;
+        timers[index] = std::move(entry);
+    }
 
+}
\ No newline at end of file
@@ -3,100 +3,474 @@
 
 #include <memory>
 #include <vector>
-#include <set>
 #include <shared_mutex>
 #include <assert.h>
 #include <functional>
 #include <mutex>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+#include "stats.h"
 
 namespace sylar {
 
 class TimerManager; // 定时器管理类
+struct TimerShard; // 定时器分片，每个工作线程一个
+
+// 定时器回调：小对象内联存储的可调用对象。
+// 捕获不超过INLINE_SIZE字节的lambda直接放在Timer内部，不像std::function那样超过16字节就要堆分配
+class TimerCallback
+{
+public:
+    static const size_t INLINE_SIZE = 48;
+
+    TimerCallback() {}
+    TimerCallback(std::nullptr_t) {}
+
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, TimerCallback>::value &&
+        std::is_invocable_r<void, typename std::decay<F>::type&>::value>::type>
+    TimerCallback(F&& f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        // 空的std::function或空函数指针 -> 空回调
+        if constexpr (std::is_constructible<bool, const Fn&>::value)
+        {
+            if(!static_cast<bool>(f))
+            {
+                return;
+            }
+        }
+        if constexpr (sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t)
+                      && std::is_nothrow_move_constructible<Fn>::value)
+        {
+            new (m_buf) Fn(std::forward<F>(f));
+            m_ops = &InlineOps<Fn>::ops;
+        }
+        else
+        {
+            // 太大的可调用对象退回堆上保存，缓冲区里只放指针
+            *reinterpret_cast<Fn**>(m_buf) = new Fn(std::forward<F>(f));
+            m_ops = &HeapOps<Fn>::ops;
+        }
+    }
+
+    TimerCallback(const TimerCallback& other) : m_ops(other.m_ops)
+    {
+        if(m_ops)
+        {
+            m_ops->copy(m_buf, other.m_buf);
+        }
+    }
+
+    TimerCallback(TimerCallback&& other) noexcept : m_ops(other.m_ops)
+    {
+        if(m_ops)
+        {
+            m_ops->move(m_buf, other.m_buf);
+            other.m_ops = nullptr;
+        }
+    }
+
+    TimerCallback& operator=(const TimerCallback& other)
+    {
+        if(this != &other)
+        {
+            TimerCallback tmp(other);
+            *this = std::move(tmp);
+        }
+        return *this;
+    }
+
+    TimerCallback& operator=(TimerCallback&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            m_ops = other.m_ops;
+            if(m_ops)
+            {
+                m_ops->move(m_buf, other.m_buf);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    TimerCallback& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    ~TimerCallback() {reset();}
+
+    void operator()() const {m_ops->invoke(const_cast<unsigned char*>(m_buf));}
+    explicit operator bool() const {return m_ops != nullptr;}
+    bool operator==(std::nullptr_t) const {return m_ops == nullptr;}
+    bool operator!=(std::nullptr_t) const {return m_ops != nullptr;}
+
+private:
+    void reset()
+    {
+        if(m_ops)
+        {
+            m_ops->destroy(m_buf);
+            m_ops = nullptr;
+        }
+    }
+
+    // 类型擦除后的操作表，每种可调用类型一份静态实例
+    struct Ops
+    {
+        void (*invoke)(void* buf);
+        void (*copy)(void* dst, const void* src);
+        void (*move)(void* dst, void* src); // 移动后销毁src
+        void (*destroy)(void* buf);
+    };
+
+    template<typename Fn>
+    struct InlineOps
+    {
+        static void invoke(void* buf) {(*static_cast<Fn*>(buf))();}
+        static void copy(void* dst, const void* src) {new (dst) Fn(*static_cast<const Fn*>(src));}
+        static void move(void* dst, void* src)
+        {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        }
+        static void destroy(void* buf) {static_cast<Fn*>(buf)->~Fn();}
+        static constexpr Ops ops = {&invoke, &copy, &move, &destroy};
+    };
+
+    template<typename Fn>
+    struct HeapOps
+    {
+        static void invoke(void* buf) {(**static_cast<Fn**>(buf))();}
+        static void copy(void* dst, const void* src) {*static_cast<Fn**>(dst) = new Fn(**static_cast<Fn* const*>(src));}
+        static void move(void* dst, void* src) {*static_cast<Fn**>(dst) = *static_cast<Fn**>(src);}
+        static void destroy(void* buf) {delete *static_cast<Fn**>(buf);}
+        static constexpr Ops ops = {&invoke, &copy, &move, &destroy};
+    };
+
+private:
+    alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+    const Ops* m_ops = nullptr;
+};
+
+// 定时器对象池：每个线程缓存一批固定大小的内存块，块不够时从全局链表批量补充，全局链表也空了才向系统申请一整片。
+// Timer连同shared_ptr的控制块一起放在一个块里，稳定状态下反复addTimer/cancel不会调用malloc。
+class TimerPool
+{
+public:
+    // 一个块能容纳Timer + shared_ptr控制块
+    static const size_t BLOCK_SIZE = 256;
+
+    static void* Allocate();
+    static void Deallocate(void* p);
+};
+
+// 供std::allocate_shared使用的分配器：大小合适的请求走TimerPool，其余的走operator new
+template<typename T>
+struct TimerAllocator
+{
+    typedef T value_type;
+
+    TimerAllocator() {}
+    template<typename U>
+    TimerAllocator(const TimerAllocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        if(sizeof(T) * n <= TimerPool::BLOCK_SIZE && alignof(T) <= alignof(std::max_align_t))
+        {
+            return static_cast<T*>(TimerPool::Allocate());
+        }
+        return static_cast<T*>(::operator new(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if(sizeof(T) * n <= TimerPool::BLOCK_SIZE && alignof(T) <= alignof(std::max_align_t))
+        {
+            TimerPool::Deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    // Timer的构造函数是私有的，由分配器(Timer的友元)负责构造
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    bool operator==(const TimerAllocator<U>&) const {return true;}
+    template<typename U>
+    bool operator!=(const TimerAllocator<U>&) const {return false;}
+};
+
     // 继承的public是用来返回智能指针timer的this值
 class Timer : public std::enable_shared_from_this<Timer> 
 {
     friend class TimerManager; // 设置成友元访问timerManager类的函数和成员变量
+    friend struct TimerShard;
+    template<typename T> friend struct TimerAllocator;
 public:
     // 从时间堆中删除timer
     bool cancel();
 
     // 刷新timer
+    // 惰性定时器(addLazyTimer创建)只原子地记录新的超时时间，不加锁也不调整堆
     bool refresh();
     // 重设timer的超时时间
     // ms定时器执行间隔时间(ms)，from_now是否从当前时间开始计算
     bool reset(uint64_t ms, bool from_now);
+    // 纳秒精度版本
+    bool reset(std::chrono::nanoseconds interval, bool from_now);
+
+    // 重新启用timer：换上新的回调(和条件)，超时时间设为从现在起timeout之后。
+    // 已经触发或被cancel()的timer也可以重新启用，用于同一个fd上连续的等待复用同一个定时器对象，省去创建和销毁
+    void restart(std::chrono::nanoseconds timeout, TimerCallback cb);
+    void restart(std::chrono::nanoseconds timeout, TimerCallback cb, std::weak_ptr<void> weak_cond);
+
+    // 允许的延迟触发时间。定时器可能在[m_next, m_next + slack]内的任意时刻触发
+    std::chrono::nanoseconds getSlack() const {return m_slack;}
+    // 管理此timer的管理器
+    TimerManager* getManager() const {return m_manager;}
+    // 管理此timer的管理器的编号(TimerManager::getId())。管理器析构后timer可能还被别处持有，用编号而不是地址判断归属
+    uint64_t getManagerId() const {return m_managerId;}
 
 private:
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+    Timer(std::chrono::nanoseconds interval, TimerCallback cb, bool recurring, TimerManager* manager,
+          std::chrono::nanoseconds slack = std::chrono::nanoseconds(0));
+
+    void restart(std::chrono::nanoseconds timeout, TimerCallback cb, std::weak_ptr<void> weak_cond, bool conditional);
  
 private:
     // 是否循环
     bool m_recurring = false;
-    // 超时时间。指超出计时的总时间，而不是两个时间的差值
-    uint64_t m_ms = 0;
+    // 超时时间。指超出计时的总时间，而不是两个时间的差值。内部统一用纳秒保存。
+    // 在分片锁内修改；惰性定时器的refresh()不加锁读取，所以是原子的
+    std::atomic<std::chrono::nanoseconds> m_interval{std::chrono::nanoseconds(0)};
+    // 允许的延迟，0表示精确触发
+    std::chrono::nanoseconds m_slack{0};
     // 绝对超时时间，即该定时器下一次触发的时间点。
     std::chrono::time_point<std::chrono::system_clock> m_next;
     // 超时时触发的回调函数
-    std::function<void()> m_cb;
+    TimerCallback m_cb;
+    // 条件定时器的条件，触发时条件对象已经析构则不执行回调
+    std::weak_ptr<void> m_cond;
+    bool m_conditional = false;
     // 管理此timer的管理器
     TimerManager* m_manager = nullptr;
+    uint64_t m_managerId = 0;
+    // 此timer所在的分片(创建它的工作线程的分片)，对它的所有修改只锁这个分片
+    TimerShard* m_shard = nullptr;
+    // 在时间堆数组中的下标，(size_t)-1表示不在堆中。cancel/refresh/reset直接按下标定位，无需find()
+    size_t m_heapIndex = (size_t)-1;
+    // 是否是惰性定时器
+    bool m_lazy = false;
+    // 惰性定时器refresh()写入的最新超时时间(ns，system_clock纪元)，0表示已取消。
+    // 堆中的m_next只在它到达堆顶时才和这里同步：时间被推后了就重新入堆，否则才真正触发
+    std::atomic<int64_t> m_lazyNext = {0};
+};
 
-private:
-    // 实现最小堆(set)的比较函数，用于比较两个Timer对象，比较的依据是绝对超时时间。
-    struct Comparator 
-    {
-        bool operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const;
-    };
+// 堆中的一个元素。触发时间(已按slack取整)冗余保存在数组中，sift时比较连续内存而不必解引用Timer
+struct TimerHeapEntry
+{
+    std::chrono::time_point<std::chrono::system_clock> next;
+    std::shared_ptr<Timer> timer;
+};
+
+// 定时器分片：一把锁 + 一个时间堆。
+// 每个工作线程创建的定时器放在自己的分片里，addTimer/cancel/refresh只竞争这一个分片的锁；
+// 对齐到缓存行，避免相邻分片的锁互相伪共享。
+struct alignas(64) TimerShard
+{
+    std::shared_mutex mutex;
+    // 时间堆：4叉最小堆，存放在连续的vector中，堆顶timers[0]是该分片最早超时的定时器。
+    // 每个Timer记录自己的下标(m_heapIndex)，所以删除和调整都是O(log n)，也不需要为每个定时器分配set节点。
+    std::vector<TimerHeapEntry> timers;
+    // 堆顶的触发时间(ns，system_clock纪元)，堆为空时为INT64_MAX。持有写锁时发布，其他线程不加锁读取，判断这个分片有没有到期的定时器
+    std::atomic<int64_t> topNs = {INT64_MAX};
+    // 在管理器中的下标，0号是未绑定的线程共用的分片
+    size_t index = 0;
+    // 分片各自唤醒时使用：负责它的线程上次计算等待时间之后，堆顶提前是否已经通知过
+    std::atomic<bool> tickled = {false};
+    // 分片各自收集时，上次检查系统时间是否回退的绝对时间(ns)
+    std::atomic<int64_t> previousNs = {0};
+
+    // 统计计数，只在持有该分片写锁时修改，不同分片的计数不会互相争用缓存行
+    uint64_t inserted = 0;
+    uint64_t cancelled = 0;
+    uint64_t fired = 0;
+    uint64_t tickles = 0;
+
+    // 时间堆操作，调用方需持有写锁
+    // 插入一个timer，返回插入后是否位于堆顶
+    bool push(const std::shared_ptr<Timer>& timer);
+    // 删除下标为index的timer
+    void erase(size_t index);
+    // 下标为index的timer的m_next被修改后，重新计算排序键并调整它在堆中的位置
+    void reschedule(size_t index);
+    // 按已有的排序键调整下标为index的元素的位置，不重新计算(保留push时并入的时间桶)
+    void update(size_t index);
+    void siftUp(size_t index);
+    void siftDown(size_t index);
+    // 堆顶变化后更新topNs，调用方需持有写锁
+    void publishTop();
+
+    // 计算timer在堆中排序用的触发时间：m_next按slack向上取整到时间桶的边界
+    static std::chrono::time_point<std::chrono::system_clock> bucketTime(const Timer& timer);
+    // 排序键：bucketTime，堆顶仍在timer的容忍范围内时直接并入堆顶所在的时间桶
+    std::chrono::time_point<std::chrono::system_clock> sortKey(const Timer& timer) const;
+};
+
+// 定时器统计快照。计数都是累计值，两次快照相减再除以time的差值即为速率
+struct TimerStats
+{
+    // 快照时间
+    std::chrono::steady_clock::time_point time;
+    // 当前堆中的定时器数量
+    uint64_t live = 0;
+    // 累计添加/取消/触发的定时器数量
+    uint64_t inserted = 0;
+    uint64_t cancelled = 0;
+    uint64_t fired = 0;
+    // onTimerInsertedAtFront()的调用次数，即因定时器插到堆顶而唤醒epoll_wait的次数
+    uint64_t tickles = 0;
+    // 触发延迟(ns)：从m_next到回调真正开始执行的时间差，包括在调度队列中排队的时间
+    Histogram::Snapshot lateness;
 };
 
 class TimerManager 
 {
     friend class Timer;
 public:
-    TimerManager();
+    // shards分片数量：0号分片由非工作线程共享，其余分片由bindTimerShard()分配给各工作线程
+    explicit TimerManager(size_t shards = 1);
     virtual ~TimerManager();
 
+    // 管理器的编号，进程内唯一且不会复用(从1开始)。新的管理器可能恰好构造在已经析构的管理器的地址上，地址不能用来判断归属
+    uint64_t getId() const {return m_id;}
+
     // 添加timer
     // ms定时器执行间隔时间
     // cb定时器回调函数
     // recurring是否循环定时器
-    std::shared_ptr<Timer> addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    // slack允许的延迟触发时间(ms)，(uint64_t)-1表示使用管理器的默认值
+    std::shared_ptr<Timer> addTimer(uint64_t ms, TimerCallback cb, bool recurring = false, uint64_t slack = (uint64_t)-1);
 
     // 添加条件timer
     // weak_cond条件
-    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, TimerCallback cb, std::weak_ptr<void> weak_cond, bool recurring = false, uint64_t slack = (uint64_t)-1);
+
+    // 纳秒精度版本，用于usleep/nanosleep以及限速等需要亚毫秒定时的场景
+    // slack为负数表示使用管理器的默认值
+    std::shared_ptr<Timer> addTimer(std::chrono::nanoseconds interval, TimerCallback cb, bool recurring = false,
+                                    std::chrono::nanoseconds slack = std::chrono::nanoseconds(-1));
+    std::shared_ptr<Timer> addConditionTimer(std::chrono::nanoseconds interval, TimerCallback cb, std::weak_ptr<void> weak_cond,
+                                             bool recurring = false, std::chrono::nanoseconds slack = std::chrono::nanoseconds(-1));
+
+    // 添加惰性定时器，适用于连接空闲超时这类频繁refresh()、很少真正触发的定时器。
+    // refresh()只是一次原子写，定时器到达堆顶时若发现超时时间被推后，则按新时间重新入堆而不触发
+    std::shared_ptr<Timer> addLazyTimer(uint64_t ms, TimerCallback cb);
+    std::shared_ptr<Timer> addLazyTimer(std::chrono::nanoseconds interval, TimerCallback cb);
 
-    // 拿到堆中最近的超时时间
+    // 设置/获取默认的延迟容忍时间。
+    // 超时时间会被向上取整到slack的整数倍，相近的定时器落入同一个时间桶里一起触发，从而减少epoll_wait的唤醒次数
+    void setDefaultSlack(uint64_t ms) {m_defaultSlack = ms * 1000 * 1000;}
+    void setDefaultSlack(std::chrono::nanoseconds slack) {m_defaultSlack = slack.count();}
+    std::chrono::nanoseconds getDefaultSlack() const {return std::chrono::nanoseconds(m_defaultSlack);}
+
+    // 拿到最近的超时时间(ms)，不足1ms的部分向上取整，避免epoll_wait以0超时空转
     uint64_t getNextTimer();
+    // 拿到最近的超时时间(ns)，没有定时器时返回~0ull。
+    // 只读一次所有分片共享的最早时间，不加锁也不遍历分片；它可能早于实际(最早的定时器刚被取消)，届时醒来由listExpiredCb重新计算。
+    // 分片各自唤醒时不维护共享的最早时间，改为遍历各分片的堆顶
+    uint64_t getNextTimerNs();
 
-    // 取出所有超时定时器的回调函数
+    // 取出超时定时器的回调函数。最早时间还没到时直接返回，到了也只锁有到期定时器的分片
     void listExpiredCb(std::vector<std::function<void()>>& cbs);
 
+    // 分片各自唤醒时由负责分片的线程调用：只看当前线程绑定的分片，with_shared时再加上0号分片
+    uint64_t getLocalNextTimerNs(bool with_shared);
+    void listLocalExpiredCb(std::vector<std::function<void()>>& cbs, bool with_shared);
+
     // 堆中是否有timer
     bool hasTimer();
 
+    // 获取定时器的统计快照
+    TimerStats getStats();
+    // 清空触发延迟直方图，累计计数不受影响
+    void resetLateness() {m_lateness.reset();}
+
 protected:
-    // 当一个最早的timer加入到堆中 -> 调用该函数
-    virtual void onTimerInsertedAtFront() {};
+    // 当一个最早的timer加入到堆中 -> 调用该函数。shard是它所在分片的下标，分片各自唤醒时只需唤醒负责这个分片的线程
+    virtual void onTimerInsertedAtFront(size_t /*shard*/) {};
+
+    // 分片各自唤醒：每个分片只由绑定它的线程(0号分片由调用方指定的一个线程)计算等待时间、收集到期的定时器，
+    // 插到堆顶时只通知负责的线程，不再维护所有分片共享的最早时间。要在任何线程绑定分片之前设置
+    void setLocalWakeup(bool v) {m_localWakeup = v;}
 
     // 添加timer
     void addTimer(std::shared_ptr<Timer> timer);
 
+    // 为当前线程分配一个独占的定时器分片，之后该线程创建的定时器都放进这个分片。由工作线程在进入调度循环时调用。
+    // 返回分片的下标，分片用完时为0(共享分片)
+    size_t bindTimerShard();
+    // 当前线程不再是工作线程，之后创建的定时器回到共享的0号分片
+    void unbindTimerShard();
+
 private:
-    // 当系统时间改变时 -> 调用该函数
-    bool detectClockRollover();
+    // 当系统时间改变时 -> 调用该函数。previous是上次检查的时间，和这次的交换
+    bool detectClockRollover(int64_t now_ns, std::atomic<int64_t>& previous);
+    // 取出一个分片中到期的定时器，调用方不持有分片的锁
+    void drainShard(TimerShard* shard, std::chrono::time_point<std::chrono::system_clock> now, bool rollover,
+                    std::vector<std::function<void()>>& cbs);
+
+    // 分片的堆顶变化后调用，调用方需持有该分片的写锁：发布分片的堆顶时间，比共享的最早时间还早时降低它。
+    // 返回是否需要调用onTimerInsertedAtFront()：最早时间被提前了，并且在下次getNextTimerNs()之前还没有唤醒过
+    bool publishShardTop(TimerShard* shard);
+    // 把共享的最早时间降到ns，返回是否真的降低了
+    bool lowerMinNext(int64_t ns);
+    // 按各分片的堆顶重新计算共享的最早时间(不加锁)
+    void recomputeMinNext();
+
+    // 当前线程创建定时器时使用的分片
+    TimerShard* localShard();
+    // 当前线程负责的分片：绑定的分片，with_shared时再加上0号分片(不重复)，不足两个时shards[1]为nullptr
+    void localShards(bool with_shared, TimerShard* shards[2]);
 
 private:
-    std::shared_mutex m_mutex;
-    // 时间堆。不过这里好像用的是set自动排序，而不是最小堆
-    std::set<std::shared_ptr<Timer>, Timer::Comparator> m_timers;
-    // 存储所有的 Timer 对象，并使用 Timer::Comparator 进行排序，确保最早超时的 Timer 在最前面。
+    const uint64_t m_id;
+    // 0号分片给未绑定的线程共用；分片数量在构造时确定，之后不再变化，遍历时不需要加锁
+    std::vector<std::unique_ptr<TimerShard>> m_shards;
+    // 下一个可分配给工作线程的分片下标
+    std::atomic<size_t> m_nextShard = {1};
 
+    // 所有分片堆顶时间的下界(ns)：插入时降低，只在listExpiredCb以及取消最早的定时器时按各分片的topNs重新计算
+    std::atomic<int64_t> m_minNext = {INT64_MAX};
     // 在下次getNextTimer()执行前 onTimerInsertedAtFront()是否已经被触发了 -> 在此过程中 onTimerInsertedAtFront()只执行一次
-    // 表示是否已经通知过事件循环，也就是onTimerInsertedAtFront()。如果getNextTimer()，获取了新时钟了，也就要标记为没通知
-    bool m_tickled = false;
-    // 上次检查系统时间是否回退的绝对时间
-    std::chrono::time_point<std::chrono::system_clock> m_previouseTime;
+    std::atomic<bool> m_tickled = {false};
+
+    // 是否分片各自唤醒，见setLocalWakeup
+    bool m_localWakeup = false;
+
+    // 新建定时器默认的延迟容忍时间(ns)
+    std::atomic<int64_t> m_defaultSlack = {0};
+    // 上次检查系统时间是否回退的绝对时间(ns)
+    std::atomic<int64_t> m_previouseTime = {0};
+
+    // 定时器触发延迟(ns)
+    Histogram m_lateness;
 };
 
 }
@@ -0,0 +1,280 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <algorithm>
+#include <cassert>
+
+namespace sylar {
+
+    static int io_uring_setup(unsigned entries, io_uring_params* p)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr)
+    {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+    }
+
+    IoUring::IoUring()
+    {
+    }
+
+    IoUring::~IoUring()
+    {
+        if(m_sqes)
+        {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if(m_cqRing && m_cqRing != m_sqRing)
+        {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        if(m_sqRing)
+        {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+        if(m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    bool IoUring::init(unsigned entries, unsigned cq_entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CLAMP;
+        if(cq_entries)
+        {
+            params.flags |= IORING_SETUP_CQSIZE;
+            params.cq_entries = cq_entries;
+        }
+
+        m_fd = io_uring_setup(entries, &params);
+        if(m_fd < 0)
+        {
+            std::cerr << "IoUring::init io_uring_setup failed: " << strerror(errno) << std::endl;
+            m_fd = -1;
+            return false;
+        }
+
+        // 提交队列和完成队列的环形缓冲区，新内核(FEAT_SINGLE_MMAP)可以一次mmap
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap)
+        {
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        }
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if(m_sqRing == MAP_FAILED)
+        {
+            std::cerr << "IoUring::init mmap sq ring failed: " << strerror(errno) << std::endl;
+            m_sqRing = nullptr;
+            return false;
+        }
+
+        if(single_mmap)
+        {
+            m_cqRing = m_sqRing;
+        }
+        else
+        {
+            m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if(m_cqRing == MAP_FAILED)
+            {
+                std::cerr << "IoUring::init mmap cq ring failed: " << strerror(errno) << std::endl;
+                m_cqRing = nullptr;
+                return false;
+            }
+        }
+
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if(m_sqes == MAP_FAILED)
+        {
+            std::cerr << "IoUring::init mmap sqes failed: " << strerror(errno) << std::endl;
+            m_sqes = nullptr;
+            return false;
+        }
+
+        char* sq = (char*)m_sqRing;
+        m_sqHead    = (unsigned*)(sq + params.sq_off.head);
+        m_sqTail    = (unsigned*)(sq + params.sq_off.tail);
+        m_sqArray   = (unsigned*)(sq + params.sq_off.array);
+        m_sqFlags   = (unsigned*)(sq + params.sq_off.flags);
+        m_sqMask    = *(unsigned*)(sq + params.sq_off.ring_mask);
+        m_sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+        m_sqeTail = m_sqeSubmitted = *m_sqTail;
+
+        char* cq = (char*)m_cqRing;
+        m_cqHead = (unsigned*)(cq + params.cq_off.head);
+        m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+        m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        m_cqes   = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    io_uring_sqe* IoUring::getSqe()
+    {
+        unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if(m_sqeTail - head >= m_sqEntries)
+        {
+            return nullptr;
+        }
+        unsigned index = m_sqeTail & m_sqMask;
+        io_uring_sqe* sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqArray[index] = index;
+        ++m_sqeTail;
+        return sqe;
+    }
+
+    int IoUring::submit()
+    {
+        // 发布新的尾指针，内核从head消费到tail
+        if(m_sqeSubmitted != m_sqeTail)
+        {
+            __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+            m_sqeSubmitted = m_sqeTail;
+        }
+
+        // 上一次没有被内核全部接收的SQE也一起提交
+        unsigned to_submit = m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if(to_submit == 0)
+        {
+            return 0;
+        }
+
+        int rt;
+        do
+        {
+            rt = io_uring_enter(m_fd, to_submit, 0, 0);
+        } while(rt < 0 && errno == EINTR);
+
+        if(rt < 0)
+        {
+            return -errno;
+        }
+        return rt;
+    }
+
+    void IoUring::flushOverflow()
+    {
+        int rt;
+        do
+        {
+            rt = io_uring_enter(m_fd, 0, 0, IORING_ENTER_GETEVENTS);
+        } while(rt < 0 && errno == EINTR);
+    }
+
+    int IoUring::registerOp(unsigned opcode, void* arg, unsigned nr)
+    {
+        int rt = io_uring_register(m_fd, opcode, arg, nr);
+        return rt < 0 ? -errno : rt;
+    }
+
+    UringBufferRing::UringBufferRing()
+    {
+    }
+
+    UringBufferRing::~UringBufferRing()
+    {
+        if(m_ring && m_uring)
+        {
+            io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = m_group;
+            m_uring->registerOp(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        if(m_ring)
+        {
+            munmap(m_ring, m_ringSize);
+        }
+        if(m_buffers)
+        {
+            munmap(m_buffers, m_buffersSize);
+        }
+    }
+
+    bool UringBufferRing::init(IoUring& ring, uint16_t group, unsigned count, unsigned size)
+    {
+        assert(count > 0 && count <= 32768 && (count & (count - 1)) == 0);
+        m_count = count;
+        m_size = size;
+        m_group = group;
+
+        // 环本身要求页对齐，缓冲区按需由内核缺页分配
+        m_ringSize = count * sizeof(io_uring_buf);
+        void* mem = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED)
+        {
+            std::cerr << "UringBufferRing::init mmap ring failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_ring = (io_uring_buf_ring*)mem;
+
+        m_buffersSize = (size_t)count * size;
+        mem = mmap(nullptr, m_buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED)
+        {
+            std::cerr << "UringBufferRing::init mmap buffers failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_buffers = (char*)mem;
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)m_ring;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        int rt = ring.registerOp(IORING_REGISTER_PBUF_RING, &reg, 1);
+        if(rt < 0)
+        {
+            std::cerr << "UringBufferRing::init register failed: " << strerror(-rt) << std::endl;
+            return false;
+        }
+        m_uring = &ring;
+
+        // 一开始所有缓冲区都交给内核
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(unsigned i = 0; i < count; ++i)
+        {
+            add((uint16_t)i);
+        }
+        return true;
+    }
+
+    void UringBufferRing::recycle(uint16_t bid)
+    {
+        assert(bid < m_count);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        add(bid);
+    }
+
+    void UringBufferRing::add(uint16_t bid)
+    {
+        // 环从第一个io_uring_buf开始，tail覆盖在bufs[0].resv上。不用m_ring->bufs：
+        // 旧内核头文件的__DECLARE_FLEX_ARRAY在C++下多出一个空结构体，bufs的偏移变成了8
+        io_uring_buf* buf = (io_uring_buf*)m_ring + (m_tail & (m_count - 1));
+        buf->addr = (uint64_t)getBuffer(bid);
+        buf->len = m_size;
+        buf->bid = bid;
+        ++m_tail;
+        // 内核看到新的尾指针时，缓冲区的内容必须已经写好
+        __atomic_store_n(&m_ring->tail, m_tail, __ATOMIC_RELEASE);
+    }
+
+}
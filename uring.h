@@ -0,0 +1,139 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <atomic>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+namespace sylar {
+
+// io_uring的最小封装，直接使用io_uring_setup/io_uring_enter系统调用和mmap共享的提交/完成队列，不依赖liburing。
+// 提交队列由sqMutex保护，多个线程可以同时提交；完成队列由reap()内部加锁，同一时刻只有一个线程在收割。
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    // 创建ring，cq_entries为0时完成队列取内核默认的两倍entries。内核不支持或者被禁用(seccomp等)时返回false
+    bool init(unsigned entries, unsigned cq_entries = 0);
+    int getFd() const {return m_fd;}
+
+    // 以下三个函数需要持有sqMutex
+    // 取一个清零的SQE，队列已满返回nullptr
+    io_uring_sqe* getSqe();
+    // 已经填写但还没有交给内核的SQE数量
+    unsigned unsubmitted() const {return m_sqeTail - m_sqeSubmitted;}
+    // 还能取出的空闲SQE数量
+    unsigned space() const {return m_sqEntries - (m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));}
+    // 把已填写的SQE交给内核(不等待完成)，返回内核接收的数量，失败返回-errno
+    int submit();
+
+    // io_uring_register，成功返回0，失败返回-errno
+    int registerOp(unsigned opcode, void* arg, unsigned nr);
+
+    // 取出所有已完成的CQE，对每一个调用fn(const io_uring_cqe&)，返回处理的数量。
+    // 完成队列溢出时内核把多出的CQE暂存起来，ring的fd不会再次变为可读，这里把它们取回来一并处理
+    template<typename F>
+    size_t reap(F fn)
+    {
+        std::lock_guard<std::mutex> lock(m_cqMutex);
+        size_t n = 0;
+        while(true)
+        {
+            unsigned head = *m_cqHead;
+            unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            while(head != tail)
+            {
+                fn(m_cqes[head & m_cqMask]);
+                ++head;
+                ++n;
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+            if(!(__atomic_load_n(m_sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+            {
+                return n;
+            }
+            flushOverflow();
+        }
+    }
+
+public:
+    std::mutex sqMutex;
+
+private:
+    // 让内核把溢出暂存的CQE搬回完成队列
+    void flushOverflow();
+
+private:
+    int m_fd = -1;
+
+    // mmap出的区域
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    // 提交队列
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned* m_sqFlags = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    // 本地的尾指针：getSqe()推进，submit()时才发布给内核
+    unsigned m_sqeTail = 0;
+    // 已经发布给内核的位置
+    unsigned m_sqeSubmitted = 0;
+
+    // 完成队列
+    std::mutex m_cqMutex;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+};
+
+// 内核提供的缓冲区环(IORING_REGISTER_PBUF_RING)。带IOSQE_BUFFER_SELECT的接收操作在数据到达时才由内核从环中取一个缓冲区，
+// 等待中的连接不占用缓冲区。取走的缓冲区用完后由recycle()放回环中
+class UringBufferRing
+{
+public:
+    UringBufferRing();
+    ~UringBufferRing();
+
+    // 分配count(2的幂)个size字节的缓冲区，以group为组号注册到ring。内核不支持时返回false
+    bool init(IoUring& ring, uint16_t group, unsigned count, unsigned size);
+    uint16_t getGroup() const {return m_group;}
+    unsigned getBufferSize() const {return m_size;}
+    // CQE中的缓冲区编号对应的缓冲区
+    char* getBuffer(uint16_t bid) const {return m_buffers + (size_t)bid * m_size;}
+    // 把缓冲区还给内核，可以在任意线程调用
+    void recycle(uint16_t bid);
+
+private:
+    // 需要持有m_mutex
+    void add(uint16_t bid);
+
+private:
+    IoUring* m_uring = nullptr;
+    std::mutex m_mutex;
+    io_uring_buf_ring* m_ring = nullptr;
+    size_t m_ringSize = 0;
+    char* m_buffers = nullptr;
+    size_t m_buffersSize = 0;
+    unsigned m_count = 0;
+    unsigned m_size = 0;
+    uint16_t m_group = 0;
+    // 本地的尾指针，add()之后发布给内核
+    uint16_t m_tail = 0;
+};
+
+}
+
+#endif